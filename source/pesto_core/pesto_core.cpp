@@ -0,0 +1,686 @@
+/// @file
+///	@brief		Out-of-line parts of the pesto~ engine: OS thread controls and the process-wide model registries
+///	@copyright	Copyright 2018 The Min-DevKit Authors. All rights reserved.
+///	@license	Use of this source code is governed by the MIT License found in the License.md file.
+
+#include "pesto_core.h"
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+
+
+bool ThreadControl::set_affinity(uint64_t cores, std::string& error) {
+#if defined(_WIN32)
+    DWORD_PTR mask = cores ? static_cast<DWORD_PTR>(cores) : ~DWORD_PTR(0);
+    if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+        error = "SetThreadAffinityMask failed (" + std::to_string(GetLastError()) + ")";
+        return false;
+    }
+    return true;
+#elif defined(__APPLE__)
+    thread_affinity_policy_data_t policy = { cores ? static_cast<integer_t>(first_core(cores) + 1) : THREAD_AFFINITY_TAG_NULL };
+    kern_return_t result = thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+                                             reinterpret_cast<thread_policy_t>(&policy), THREAD_AFFINITY_POLICY_COUNT);
+    if (result != KERN_SUCCESS) {
+        error = "thread_policy_set failed (" + std::to_string(result) + ")";
+        return false;
+    }
+    return true;
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int core_count = static_cast<int>(std::thread::hardware_concurrency());
+    for (int core = 0; core < std::max(core_count, 1); ++core) {
+        if (!cores || (core < 64 && (cores >> core) & 1)) CPU_SET(core, &set);
+    }
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (result != 0) {
+        error = std::string("pthread_setaffinity_np failed: ") + std::strerror(result);
+        return false;
+    }
+    return true;
+#endif
+}
+
+bool ThreadControl::set_priority(Priority priority, double period_seconds, std::string& error) {
+#if defined(_WIN32)
+    int level = priority == Priority::realtime ? THREAD_PRIORITY_TIME_CRITICAL
+              : priority == Priority::high ? THREAD_PRIORITY_HIGHEST : THREAD_PRIORITY_NORMAL;
+    if (!SetThreadPriority(GetCurrentThread(), level)) {
+        error = "SetThreadPriority failed (" + std::to_string(GetLastError()) + ")";
+        return false;
+    }
+    return true;
+#elif defined(__APPLE__)
+    if (priority != Priority::realtime) {
+        qos_class_t qos = priority == Priority::high ? QOS_CLASS_USER_INTERACTIVE : QOS_CLASS_DEFAULT;
+        int result = pthread_set_qos_class_self_np(qos, 0);
+        if (result != 0) {
+            error = std::string("pthread_set_qos_class_self_np failed: ") + std::strerror(result);
+            return false;
+        }
+        return true;
+    }
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    double ticks_per_second = 1e9 * timebase.denom / timebase.numer;
+    thread_time_constraint_policy_data_t policy;
+    policy.period = static_cast<uint32_t>(period_seconds * ticks_per_second);
+    policy.computation = policy.period / 2;
+    policy.constraint = policy.period;
+    policy.preemptible = 1;
+    kern_return_t result = thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_TIME_CONSTRAINT_POLICY,
+                                             reinterpret_cast<thread_policy_t>(&policy), THREAD_TIME_CONSTRAINT_POLICY_COUNT);
+    if (result != KERN_SUCCESS) {
+        error = "thread_policy_set failed (" + std::to_string(result) + ")";
+        return false;
+    }
+    return true;
+#else
+    sched_param param {};
+    int policy = SCHED_OTHER;
+    if (priority == Priority::realtime) {
+        policy = SCHED_FIFO;
+        param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 10;
+    } else if (priority == Priority::high) {
+        policy = SCHED_RR;
+        param.sched_priority = sched_get_priority_min(SCHED_RR);
+    }
+    int result = pthread_setschedparam(pthread_self(), policy, &param);
+    if (result != 0) {
+        error = std::string("pthread_setschedparam failed: ") + std::strerror(result);
+        return false;
+    }
+    return true;
+#endif
+}
+
+bool ThreadControl::set_interop_threads(int threads, std::string& error) {
+    static std::mutex mutex;
+    static int applied = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (threads <= 0 || threads == applied) return true;
+    try {
+        at::set_num_interop_threads(threads);
+        applied = threads;
+        return true;
+    }
+    catch (const c10::Error& e) {
+        error = "the inter-op thread pool is already running with " + std::to_string(at::get_num_interop_threads()) + " threads";
+        return false;
+    }
+}
+
+int ThreadControl::first_core(uint64_t cores) {
+    int core = 0;
+    while (!((cores >> core) & 1)) ++core;
+    return core;
+}
+
+
+MappedFile::MappedFile(const fs::path& path) {
+#if defined(_WIN32)
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("could not open " + path.string() + " (" + std::to_string(GetLastError()) + ")");
+    }
+    LARGE_INTEGER size {};
+    GetFileSizeEx(file, &size);
+    m_size = static_cast<size_t>(size.QuadPart);
+    HANDLE mapping = m_size ? CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    CloseHandle(file);
+    void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (mapping) CloseHandle(mapping); // The view keeps the mapping alive
+    if (!view) {
+        throw std::runtime_error("could not map " + path.string() + " (" + std::to_string(GetLastError()) + ")");
+    }
+    m_data = static_cast<const unsigned char*>(view);
+#else
+    int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0) {
+        throw std::runtime_error("could not open " + path.string() + ": " + std::strerror(errno));
+    }
+    struct stat info {};
+    ::fstat(file, &info);
+    m_size = static_cast<size_t>(info.st_size);
+    void* view = m_size ? ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+    int error = errno;
+    ::close(file);
+    if (view == MAP_FAILED) {
+        throw std::runtime_error("could not map " + path.string() + ": " + (m_size ? std::strerror(error) : "the file is empty"));
+    }
+    m_data = static_cast<const unsigned char*>(view);
+#endif
+}
+
+MappedFile::~MappedFile() {
+#if defined(_WIN32)
+    UnmapViewOfFile(m_data);
+#else
+    ::munmap(const_cast<unsigned char*>(m_data), m_size);
+#endif
+}
+
+
+// A blob is a header, one record per tensor in slot order, then the tensors' bytes,
+// each starting on a cache line. The header holds a hash of the source file's path,
+// modification time and size, its contents are checked once when it is written.
+namespace {
+
+constexpr char k_blob_magic[8] = { 'P', 'E', 'S', 'T', 'O', 'W', 'B', '2' };
+constexpr uint64_t k_blob_alignment = 64;
+
+struct BlobHeader {
+    char magic[8];
+    uint64_t count;
+    uint64_t hash;
+};
+
+struct BlobRecord {
+    uint64_t offset;
+    uint64_t bytes;
+};
+
+struct WeightSlot {
+    torch::jit::ObjectPtr object;
+    size_t index;
+    torch::Tensor tensor;
+};
+
+// The dense CPU tensors in the parameter and buffer slots of every submodule
+std::vector<WeightSlot> weight_slots(const torch::jit::script::Module& module) {
+    std::vector<WeightSlot> slots;
+    for (const auto& submodule : module.modules()) {
+        auto object = submodule._ivalue();
+        auto type = submodule.type();
+        for (size_t i = 0; i < type->numAttributes(); ++i) {
+            if (!type->is_parameter(i) && !type->is_buffer(i)) continue;
+            torch::jit::IValue slot = object->getSlot(i);
+            if (!slot.isTensor()) continue;
+            torch::Tensor tensor = slot.toTensor();
+            if (!tensor.defined() || tensor.is_quantized() || !tensor.device().is_cpu()) continue;
+            slots.push_back({ object, i, tensor });
+        }
+    }
+    return slots;
+}
+
+uint64_t align_blob(uint64_t offset) {
+    return (offset + k_blob_alignment - 1) / k_blob_alignment * k_blob_alignment;
+}
+
+// FNV-1a, continued from hash
+uint64_t hash_bytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+uint64_t hash_slots(const std::vector<WeightSlot>& slots) {
+    uint64_t hash = hash_bytes(nullptr, 0);
+    for (const auto& slot : slots) {
+        torch::Tensor tensor = slot.tensor.contiguous();
+        hash = hash_bytes(tensor.data_ptr(), tensor.nbytes(), hash);
+    }
+    return hash;
+}
+
+// Whether only the current user can have created or replaced the file (a regular file,
+// or with directory a directory, that the user owns and nobody else can write to)
+bool owned_privately(const fs::path& path, bool directory) {
+#if defined(_WIN32)
+    // Blobs live in the user's profile, which is only accessible to its owner
+    std::error_code error;
+    return directory ? fs::is_directory(path, error) : fs::is_regular_file(fs::symlink_status(path, error));
+#else
+    struct stat info {};
+    if (::lstat(path.c_str(), &info) != 0) return false;
+    bool type = directory ? S_ISDIR(info.st_mode) : S_ISREG(info.st_mode);
+    return type && info.st_uid == ::geteuid() && (info.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+#endif
+}
+
+// The identity of a model file a blob was written from
+std::string source_identity(const fs::path& model_path) {
+    return model_path.string() + "@" + std::to_string(fs::last_write_time(model_path).time_since_epoch().count())
+        + "#" + std::to_string(fs::file_size(model_path));
+}
+
+// Map an existing blob, nullptr if there is none, it isn't private to the user, or it
+// wasn't written from this source for tensors of these sizes. Only the header and the
+// record table are read, the tensors' pages are left to be paged in when they are used.
+std::shared_ptr<const MappedFile> open_blob(const fs::path& file, const std::vector<WeightSlot>& slots, uint64_t hash) {
+    if (!owned_privately(file, false)) return nullptr;
+    std::shared_ptr<const MappedFile> blob;
+    try {
+        blob = std::make_shared<const MappedFile>(file);
+    }
+    catch (const std::runtime_error&) {
+        return nullptr;
+    }
+    size_t table_end = sizeof(BlobHeader) + slots.size() * sizeof(BlobRecord);
+    if (blob->size() < table_end) return nullptr;
+    const auto* header = reinterpret_cast<const BlobHeader*>(blob->data());
+    if (std::memcmp(header->magic, k_blob_magic, sizeof(k_blob_magic)) != 0 || header->count != slots.size() ||
+        header->hash != hash) return nullptr;
+    const auto* records = reinterpret_cast<const BlobRecord*>(blob->data() + sizeof(BlobHeader));
+    for (size_t k = 0; k < slots.size(); ++k) {
+        if (records[k].offset % k_blob_alignment || records[k].bytes != slots[k].tensor.nbytes() ||
+            records[k].offset + records[k].bytes > blob->size()) return nullptr;
+    }
+    return blob;
+}
+
+// The hash of a blob's tensor bytes
+uint64_t hash_blob(const MappedFile& blob, size_t count) {
+    const auto* records = reinterpret_cast<const BlobRecord*>(blob.data() + sizeof(BlobHeader));
+    uint64_t content = hash_bytes(nullptr, 0);
+    for (size_t k = 0; k < count; ++k) content = hash_bytes(blob.data() + records[k].offset, records[k].bytes, content);
+    return content;
+}
+
+// Write a blob under a temporary name, check that it reads back as the model's own
+// tensors, and move it into place, so a process mapping the file never sees it half
+// written
+bool write_blob(const fs::path& file, const std::vector<WeightSlot>& slots, uint64_t hash, std::string& error) {
+    std::error_code fs_error;
+    std::random_device random;
+    fs::path temporary = file;
+    temporary += ".tmp" + std::to_string(random());
+
+    std::vector<BlobRecord> records(slots.size());
+    uint64_t offset = align_blob(sizeof(BlobHeader) + slots.size() * sizeof(BlobRecord));
+    for (size_t k = 0; k < slots.size(); ++k) {
+        records[k] = { offset, static_cast<uint64_t>(slots[k].tensor.nbytes()) };
+        offset = align_blob(offset + records[k].bytes);
+    }
+
+    {
+        std::ofstream out(temporary, std::ios::binary);
+        BlobHeader header {};
+        std::memcpy(header.magic, k_blob_magic, sizeof(k_blob_magic));
+        header.count = slots.size();
+        header.hash = hash;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(BlobRecord));
+        for (size_t k = 0; k < slots.size(); ++k) {
+            torch::Tensor tensor = slots[k].tensor.contiguous();
+            static const char padding[k_blob_alignment] = {};
+            out.write(padding, records[k].offset - static_cast<uint64_t>(out.tellp()));
+            out.write(static_cast<const char*>(tensor.data_ptr()), records[k].bytes);
+        }
+        if (!out) {
+            fs::remove(temporary, fs_error);
+            error = "could not write " + file.string();
+            return false;
+        }
+    }
+    bool intact = false;
+    try {
+        intact = hash_blob(MappedFile(temporary), slots.size()) == hash_slots(slots);
+    }
+    catch (const std::runtime_error&) {}
+    if (!intact) {
+        fs::remove(temporary, fs_error);
+        error = file.string() + " does not read back as the model's weights";
+        return false;
+    }
+
+    // Private to the user whatever the umask, or open_blob won't take it
+    fs::permissions(temporary, fs::perms::owner_read | fs::perms::owner_write, fs::perm_options::replace, fs_error);
+
+    // Another process may have moved its copy into place first, which is as good
+    fs::rename(temporary, file, fs_error);
+    if (fs_error) fs::remove(temporary, fs_error);
+    return true;
+}
+
+// The current user's blob directory, created private to them. Empty with a reason when
+// it exists but others could write to it.
+fs::path blob_directory(std::string& error) {
+#if defined(_WIN32)
+    const wchar_t* local = _wgetenv(L"LOCALAPPDATA");
+    fs::path directory = (local ? fs::path(local) : fs::temp_directory_path()) / "pesto" / "weights";
+    std::error_code fs_error;
+    fs::create_directories(directory, fs_error);
+#else
+    fs::path directory = fs::temp_directory_path() / ("pesto_weights-" + std::to_string(::geteuid()));
+    ::mkdir(directory.c_str(), 0700);
+#endif
+    if (!owned_privately(directory, true)) {
+        error = directory.string() + " is not a directory private to this user";
+        return {};
+    }
+    return directory;
+}
+
+} // namespace
+
+bool SharedWeights::share(torch::jit::script::Module& module, const fs::path& model_path, std::string& error) {
+    std::vector<WeightSlot> slots = weight_slots(module);
+    if (slots.empty()) {
+        error = "the model has no dense weights on the CPU";
+        return false;
+    }
+    fs::path file = blob_path(model_path, error);
+    if (file.empty()) return false;
+    std::string identity = source_identity(model_path);
+    uint64_t hash = hash_bytes(identity.data(), identity.size());
+    auto blob = open_blob(file, slots, hash);
+    if (!blob) {
+        if (!write_blob(file, slots, hash, error)) return false;
+        blob = open_blob(file, slots, hash);
+        if (!blob) {
+            error = file.string() + " does not match the model";
+            return false;
+        }
+    }
+
+    // The tensors keep the mapping alive, and point into read-only pages
+    const auto* records = reinterpret_cast<const BlobRecord*>(blob->data() + sizeof(BlobHeader));
+    for (size_t k = 0; k < slots.size(); ++k) {
+        void* data = const_cast<unsigned char*>(blob->data() + records[k].offset);
+        auto options = torch::TensorOptions().dtype(slots[k].tensor.scalar_type());
+        torch::Tensor shared = torch::from_blob(data, slots[k].tensor.sizes(), [blob](void*) {}, options);
+        slots[k].object->setSlot(slots[k].index, shared);
+    }
+    return true;
+}
+
+fs::path SharedWeights::blob_path(const fs::path& model_path, std::string& error) {
+    fs::path directory = blob_directory(error);
+    if (directory.empty()) return {};
+    // A stable hash, so every process and build names a model's blob the same way
+    std::string identity = source_identity(model_path);
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash_bytes(identity.data(), identity.size())));
+    return directory / (model_path.stem().string() + "-" + name + ".bin");
+}
+
+
+ModelCache& ModelCache::instance() {
+    static ModelCache cache;
+    return cache;
+}
+
+std::shared_ptr<const ModelCache::Entry> ModelCache::acquire(const std::string& model_path, bool optimize,
+                                                             torch::Device device, torch::ScalarType dtype, bool mapped) {
+    fs::path canonical = fs::canonical(model_path);
+    if (!supports(canonical)) {
+        throw std::runtime_error("unsupported model format " + canonical.extension().string());
+    }
+    auto mtime = fs::last_write_time(canonical).time_since_epoch().count();
+    std::string key = canonical.string() + "@" + std::to_string(mtime) + (optimize ? "+opt" : "") + (mapped ? "+mmap" : "") + ":" + device.str();
+
+    std::shared_ptr<Slot> slot;
+    {
+        auto& cache = instance();
+        std::lock_guard<std::mutex> lock(cache.m_mutex);
+        cache.purge();
+        auto& existing = cache.m_slots[key];
+        if (!existing) existing = std::make_shared<Slot>();
+        slot = existing;
+    }
+
+    // Concurrent requests for the same file wait here for a single load
+    std::lock_guard<std::mutex> lock(slot->mutex);
+    if (auto entry = slot->entry.lock()) return entry;
+
+    std::shared_ptr<const Entry> entry;
+#ifdef PESTO_WITH_ONNXRUNTIME
+    if (canonical.extension() == ".onnx") {
+        entry = std::make_shared<const OnnxEntry>(key, canonical.string(), device);
+        slot->entry = entry;
+        return entry;
+    }
+#endif
+    std::string warning;
+    torch::jit::script::Module prototype = mapped
+        ? torch::jit::load(std::make_shared<MappedReadAdapter>(std::make_shared<const MappedFile>(canonical)), device)
+        : torch::jit::load(canonical.string(), device);
+    prototype.eval();
+    if (mapped) {
+        // Before optimizing, so the weights the inference passes don't fold stay shared
+        std::string error;
+        if (!device.is_cpu()) {
+            warning = "Weights of " + canonical.filename().string() + " are only shared on the CPU";
+        } else if (!SharedWeights::share(prototype, canonical, error)) {
+            warning = "Could not share the weights of " + canonical.filename().string() + ": " + error;
+        }
+    }
+    if (optimize) {
+        // Freezing keeps attributes that forward mutates, so streaming state survives
+        try {
+            prototype = torch::jit::optimize_for_inference(prototype);
+        }
+        catch (const c10::Error& e) {
+            if (!warning.empty()) warning += "\n";
+            warning += "Could not optimize " + canonical.filename().string() + " for inference, using it as exported: " + e.what();
+        }
+    }
+    entry = std::make_shared<const TorchEntry>(key, canonical.string(), std::move(prototype), device, dtype, std::move(warning));
+    slot->entry = entry;
+    return entry;
+}
+
+
+std::shared_ptr<const ModelIndex::Snapshot> ModelIndex::snapshot(const std::vector<std::string>& directories, bool rescan) {
+    auto& index = instance();
+    std::lock_guard<std::mutex> lock(index.m_mutex);
+    auto stamps = stamp(directories);
+    if (rescan || !index.m_snapshot || directories != index.m_directories || stamps != index.m_stamps) {
+        index.m_snapshot = scan(directories);
+        index.m_directories = directories;
+        index.m_stamps = std::move(stamps);
+    }
+    return index.m_snapshot;
+}
+
+ModelIndex::ModelFile ModelIndex::parse(const fs::path& file) {
+    static const std::regex rate_pattern("sr(\\d+)k");
+    static const std::regex chunk_pattern("h(\\d+)(?:_(?:fp32|fp16|bf16|int8))?\\.(?:pt|onnx)$");
+    static const std::regex precision_pattern("_(fp32|fp16|bf16|int8)\\.(?:pt|onnx)$");
+    ModelFile model;
+    model.filename = file.filename().string();
+    model.path = file.string();
+    std::smatch matches;
+    if (std::regex_search(model.filename, matches, rate_pattern)) model.rate_tag = std::stoi(matches[1].str());
+    if (std::regex_search(model.filename, matches, chunk_pattern)) model.chunk_size = std::stoi(matches[1].str());
+    if (std::regex_search(model.filename, matches, precision_pattern)) model.precision = matches[1].str();
+    return model;
+}
+
+ModelIndex& ModelIndex::instance() {
+    static ModelIndex index;
+    return index;
+}
+
+std::vector<ModelIndex::Stamp> ModelIndex::stamp(const std::vector<std::string>& directories) {
+    std::vector<Stamp> stamps;
+    for (const auto& directory : directories) {
+        std::error_code error;
+        stamps.push_back(fs::last_write_time(directory, error));
+    }
+    return stamps;
+}
+
+std::shared_ptr<const ModelIndex::Snapshot> ModelIndex::scan(const std::vector<std::string>& directories) {
+    auto snapshot = std::make_shared<Snapshot>();
+    for (const auto& directory : directories) {
+        std::error_code error;
+        for (fs::directory_iterator it(directory, error), end; !error && it != end; it.increment(error)) {
+            if (!ModelCache::supports(it->path())) continue;
+            ModelFile model = parse(it->path());
+            if (snapshot->m_by_name.count(model.filename)) continue;
+            snapshot->m_by_name.emplace(model.filename, snapshot->m_files.size());
+            if (model.chunk_size > 0) snapshot->m_by_chunk[model.chunk_size].push_back(snapshot->m_files.size());
+            snapshot->m_files.push_back(std::move(model));
+        }
+    }
+    return snapshot;
+}
+
+
+namespace {
+
+// The raw value of a key in a flat JSON object, strings without their quotes. Empty when
+// the key is missing.
+std::string json_value(const std::string& text, const std::string& key) {
+    size_t at = text.find("\"" + key + "\"");
+    if (at == std::string::npos) return {};
+    at = text.find(':', at + key.size() + 2);
+    if (at == std::string::npos) return {};
+    at = text.find_first_not_of(" \t\r\n", at + 1);
+    if (at == std::string::npos) return {};
+    std::string value;
+    if (text[at] == '"') {
+        for (++at; at < text.size() && text[at] != '"'; ++at) {
+            if (text[at] != '\\' || at + 1 >= text.size()) {
+                value += text[at];
+                continue;
+            }
+            switch (text[++at]) {
+                case 'n': value += '\n'; break;
+                case 't': value += '\t'; break;
+                case 'r': value += '\r'; break;
+                case 'b': value += '\b'; break;
+                case 'f': value += '\f'; break;
+                case 'u':
+                    // Only the control characters json_quoted() writes this way
+                    if (at + 4 < text.size()) value += static_cast<char>(std::stoi(text.substr(at + 1, 4), nullptr, 16));
+                    at += 4;
+                    break;
+                default: value += text[at];
+            }
+        }
+        return value;
+    }
+    value = text.substr(at, text.find_first_of(",}\r\n", at) - at);
+    value.erase(value.find_last_not_of(" \t") + 1);
+    return value;
+}
+
+} // namespace
+
+std::string json_quoted(const std::string& text) {
+    std::string escaped = "\"";
+    for (char c : text) {
+        switch (c) {
+            case '"': escaped += "\\\""; break;
+            case '\\': escaped += "\\\\"; break;
+            case '\n': escaped += "\\n"; break;
+            case '\t': escaped += "\\t"; break;
+            case '\r': escaped += "\\r"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char code[8];
+                    std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(c));
+                    escaped += code;
+                } else {
+                    escaped += c;
+                }
+        }
+    }
+    return escaped + "\"";
+}
+
+TuningProfile TuningProfile::choose(const std::vector<BenchReport>& report) {
+    TuningProfile best;
+    for (const auto& entry : report) {
+        ModelIndex::ModelFile file = ModelIndex::parse(entry.model);
+        if (file.chunk_size <= 0 || file.rate_tag <= 0) continue;
+        if (file.precision != "fp32" && (!entry.accuracy.valid || entry.accuracy.mean_pitch > k_max_pitch_error)) continue;
+        
+        auto single = std::find_if(entry.runs.begin(), entry.runs.end(),
+                                   [](const BenchResult& run) { return run.mode == "single" && run.error.empty(); });
+        if (single == entry.runs.end()) continue;
+        double budget_ms = 1000.0 * file.chunk_size / ModelIndex::rate_from_tag(file.rate_tag);
+        if (single->p99_ms > k_headroom * budget_ms) continue;
+        if (best.valid() && (file.chunk_size > best.chunk_size ||
+                             (file.chunk_size == best.chunk_size && single->p99_ms >= best.p99_ms))) continue;
+        
+        best = TuningProfile();
+        best.model = file.filename;
+        best.chunk_size = file.chunk_size;
+        best.precision = file.precision;
+        best.backend = fs::path(file.filename).extension() == ".onnx" ? "onnx" : "torchscript";
+        best.p99_ms = single->p99_ms;
+        best.budget_ms = budget_ms;
+    }
+    return best;
+}
+
+TuningProfile TuningProfile::read(const fs::path& file) {
+    std::ifstream in(file);
+    if (!in) return {};
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    
+    TuningProfile profile;
+    try {
+        if (json_value(text, "version") != "1") return {};
+        profile.model = json_value(text, "model");
+        profile.chunk_size = std::stoi(json_value(text, "chunk"));
+        profile.precision = json_value(text, "precision");
+        profile.backend = json_value(text, "backend");
+        profile.device = json_value(text, "device");
+        profile.optimize = json_value(text, "optimize") == "true";
+        profile.threads = std::max(std::stoi(json_value(text, "threads")), 0);
+        profile.p99_ms = std::stod(json_value(text, "p99_ms"));
+        profile.budget_ms = std::stod(json_value(text, "budget_ms"));
+    }
+    catch (const std::exception&) {
+        return {};
+    }
+    return profile;
+}
+
+// Written to a temporary file and moved into place, so instances reading it never see
+// it half written
+bool TuningProfile::write(const fs::path& file, std::string& error) const {
+    std::error_code fs_error;
+    std::random_device random;
+    fs::path temporary = file;
+    temporary += ".tmp" + std::to_string(random());
+    {
+        std::ofstream out(temporary);
+        out << "{\n  \"version\": 1,\n  \"model\": " << json_quoted(model) << ",\n  \"chunk\": " << chunk_size
+            << ",\n  \"precision\": " << json_quoted(precision) << ",\n  \"backend\": " << json_quoted(backend)
+            << ",\n  \"device\": " << json_quoted(device) << ",\n  \"optimize\": " << (optimize ? "true" : "false")
+            << ",\n  \"threads\": " << threads << ",\n  \"p99_ms\": " << p99_ms << ",\n  \"budget_ms\": " << budget_ms
+            << ",\n  \"cores\": " << std::thread::hardware_concurrency() << "\n}\n";
+        if (!out) {
+            fs::remove(temporary, fs_error);
+            error = "could not write " + file.string();
+            return false;
+        }
+    }
+    fs::rename(temporary, file, fs_error);
+    if (fs_error) {
+        fs::remove(temporary, fs_error);
+        error = "could not replace " + file.string();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,2235 @@
+/// @file
+///	@brief		The streaming pitch estimation engine behind pesto~, free of any Max or min-api dependency
+///	@copyright	Copyright 2018 The Min-DevKit Authors. All rights reserved.
+///	@license	Use of this source code is governed by the MIT License found in the License.md file.
+
+#pragma once
+
+#include <torch/torch.h>
+#include <torch/script.h>
+#ifdef PESTO_WITH_ONNXRUNTIME
+#include <onnxruntime_cxx_api.h>
+#if defined(__APPLE__) && defined(PESTO_ONNX_COREML)
+#include <coreml_provider_factory.h>
+#endif
+#if defined(_WIN32) && defined(PESTO_ONNX_DIRECTML)
+#include <dml_provider_factory.h>
+#endif
+#endif
+#if defined(_WIN32) && !defined(_USE_MATH_DEFINES)
+#define _USE_MATH_DEFINES
+#endif
+#include <regex>
+#include <vector>
+#include <string>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#include <array>
+#include <numeric>
+#include <cmath>
+#include <limits>
+#include <optional>
+#include <latch>
+#include <random>
+namespace fs = std::filesystem;
+
+
+// Power-of-2 ceiling function for efficient circular buffer sizing
+inline unsigned power_ceil(unsigned x) {
+    if (x <= 1) return 1;
+    int power = 2;
+    x--;
+    while (x >>= 1) power <<= 1;
+    return power;
+}
+
+// The hop for a requested hop size (0 for the chunk size): the largest divisor of the
+// chunk size up to it, so chunk / hop streams with their own state cover every window
+inline int divisor_hop(int chunk_size, int requested) {
+    int hop = requested > 0 ? std::min(requested, chunk_size) : chunk_size;
+    while (chunk_size % hop != 0) --hop;
+    return hop;
+}
+
+// Single-producer single-consumer ring buffer between the audio thread (writer) and
+// the inference thread (reader). Positions are absolute sample counts and are only
+// masked on access, so the difference between them is always the unread backlog.
+// Channels are stored planar and share positions, so they always stay in lockstep.
+class CircularBuffer {
+public:
+    // What happens when the reader falls behind and the writer runs out of space
+    enum class OverrunPolicy : int {
+        drop_oldest,    // Keep writing, the reader jumps past the overwritten audio
+        skip_to_latest, // Keep writing, the reader only ever analyses the newest chunk
+        block,          // Stop writing when full, newly arriving audio is discarded
+        enum_count
+    };
+
+private:
+    std::vector<float> buffer;
+    std::atomic<size_t> write_pos{0};
+    std::atomic<size_t> read_pos{0};
+    size_t capacity;
+    size_t mask; // For power-of-2 optimization
+    size_t channels;
+    std::atomic<OverrunPolicy> policy{OverrunPolicy::drop_oldest};
+    std::atomic<uint64_t> overrun_samples{0}; // Audio lost because the reader was too slow
+    std::atomic<uint64_t> underrun_count{0};  // Reads that found less than a window
+    std::atomic<uint32_t> clear_epoch{0};     // Bumped by clear(), positions restart from 0
+    std::atomic<uint64_t> origin{0};          // Samples written before positions last restarted
+    
+    // Copy into one channel of the ring in at most two contiguous segments
+    template<typename T>
+    void write(size_t channel, size_t pos, const T* src, size_t count) {
+        float* base = &buffer[channel * capacity];
+        size_t start = pos & mask;
+        size_t first = std::min(count, capacity - start);
+        if constexpr (std::is_same_v<T, float>) {
+            std::memcpy(base + start, src, first * sizeof(float));
+            std::memcpy(base, src + first, (count - first) * sizeof(float));
+        } else {
+            for (size_t i = 0; i < first; ++i) base[start + i] = static_cast<float>(src[i]);
+            for (size_t i = first; i < count; ++i) base[i - first] = static_cast<float>(src[i]);
+        }
+    }
+    
+    // Copy out of one channel of the ring in at most two contiguous segments
+    void read(size_t channel, size_t pos, float* dest, size_t count) const {
+        const float* base = &buffer[channel * capacity];
+        size_t start = pos & mask;
+        size_t first = std::min(count, capacity - start);
+        std::memcpy(dest, base + start, first * sizeof(float));
+        std::memcpy(dest + first, base, (count - first) * sizeof(float));
+    }
+    
+public:
+    CircularBuffer() : capacity(0), mask(0), channels(1) {}
+    
+    void resize(size_t size, size_t channel_count = 1) {
+        capacity = power_ceil(size);
+        mask = capacity - 1;
+        channels = std::max<size_t>(channel_count, 1);
+        buffer.resize(capacity * channels);
+        origin.fetch_add(write_pos.exchange(0), std::memory_order_release);
+        read_pos = 0;
+    }
+    
+    size_t channel_count() const {
+        return channels;
+    }
+    
+    void set_policy(OverrunPolicy new_policy) {
+        policy.store(new_policy, std::memory_order_relaxed);
+    }
+    
+    // Append a block of samples to every channel (audio thread only, never blocks or allocates)
+    template<typename T>
+    void put(const T* const* srcs, size_t count) {
+        size_t w = write_pos.load(std::memory_order_relaxed);
+        size_t offset = 0;
+        
+        if (policy.load(std::memory_order_relaxed) == OverrunPolicy::block) {
+            size_t space = capacity - std::min(capacity, w - read_pos.load(std::memory_order_acquire));
+            if (count > space) {
+                overrun_samples.fetch_add(count - space, std::memory_order_relaxed);
+                count = space;
+            }
+        } else if (count > capacity) {
+            // Only the newest samples can survive a write larger than the ring
+            w += count - capacity;
+            offset = count - capacity;
+            count = capacity;
+        }
+        
+        for (size_t channel = 0; channel < channels; ++channel) {
+            write(channel, w, srcs[channel] + offset, count);
+        }
+        write_pos.store(w + count, std::memory_order_release);
+    }
+    
+    template<typename T>
+    void put(const T* src, size_t count) {
+        put(&src, count);
+    }
+    
+    void put(float sample) {
+        put(&sample, 1);
+    }
+    
+    bool get(float* dest, size_t count) {
+        return read_window(dest, count, count);
+    }
+    
+    bool read_window(float* dest, size_t window, size_t hop, size_t* start = nullptr) {
+        return read_window(&dest, window, hop, start);
+    }
+    
+    // Copy the oldest unread window of every channel and consume hop samples of it
+    // (inference thread only). When the writer has lapped the reader, or more than one chunk is
+    // pending with skip_to_latest, the reader jumps forward in whole windows so the
+    // stream stays aligned, and the skipped audio is counted as overrun.
+    bool read_window(float* const* dests, size_t window, size_t hop, size_t* start = nullptr) {
+        if (window == 0 || window > capacity) return false;
+        
+        while (true) {
+            size_t r = read_pos.load(std::memory_order_relaxed);
+            size_t w = write_pos.load(std::memory_order_acquire);
+            size_t backlog = w - r;
+            size_t skip = 0;
+            
+            switch (policy.load(std::memory_order_relaxed)) {
+                case OverrunPolicy::drop_oldest:
+                    // Leave the writer a quarter of the ring of headroom while we copy
+                    if (backlog > capacity - capacity / 4) {
+                        skip = (backlog - capacity / 2 + window - 1) / window * window;
+                    }
+                    break;
+                case OverrunPolicy::skip_to_latest:
+                    if (backlog >= 2 * window) {
+                        skip = (backlog - window) / window * window;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            
+            if (skip > 0) {
+                skip = std::min(skip, backlog);
+                r += skip;
+                backlog -= skip;
+                overrun_samples.fetch_add(skip, std::memory_order_relaxed);
+                read_pos.store(r, std::memory_order_release);
+            }
+            
+            if (backlog < window) return false;
+            
+            for (size_t channel = 0; channel < channels; ++channel) {
+                read(channel, r, dests[channel], window);
+            }
+            
+            // If the writer lapped us during the copy the window is torn, try again
+            if (write_pos.load(std::memory_order_acquire) - r > capacity) continue;
+            
+            read_pos.store(r + hop, std::memory_order_release);
+            if (start) *start = r;
+            return true;
+        }
+    }
+    
+    size_t available() const {
+        return write_pos.load(std::memory_order_acquire) - read_pos.load(std::memory_order_acquire);
+    }
+    
+    size_t size() const {
+        return capacity;
+    }
+    
+    // Position of the next sample to be written (writer side)
+    size_t write_position() const {
+        return write_pos.load(std::memory_order_relaxed);
+    }
+    
+    uint32_t epoch() const {
+        return clear_epoch.load(std::memory_order_acquire);
+    }
+    
+    // Count of the samples written before a position, since the buffer was created. Unlike
+    // positions it carries on across clear() and resize(), so it keeps timestamps monotonic.
+    uint64_t stream_position(size_t position) const {
+        return origin.load(std::memory_order_acquire) + position;
+    }
+    
+    void record_underrun() {
+        underrun_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    
+    uint64_t overruns() const {
+        return overrun_samples.load(std::memory_order_relaxed);
+    }
+    
+    uint64_t underruns() const {
+        return underrun_count.load(std::memory_order_relaxed);
+    }
+    
+    void clear() {
+        origin.fetch_add(write_pos.exchange(0), std::memory_order_release);
+        read_pos = 0;
+        clear_epoch.fetch_add(1, std::memory_order_release);
+    }
+};
+
+
+// Fixed-capacity lock-free queue with a single producer and a single consumer,
+// for handing small records between threads without locks or allocation
+template<typename T, size_t Capacity>
+class SpscQueue {
+    static_assert((Capacity & (Capacity - 1)) == 0, "SpscQueue capacity must be a power of 2");
+    
+public:
+    // Producer side, returns false if the queue is full
+    bool push(const T& item) {
+        size_t w = m_write.load(std::memory_order_relaxed);
+        if (w - m_read.load(std::memory_order_acquire) == Capacity) return false;
+        m_items[w & (Capacity - 1)] = item;
+        m_write.store(w + 1, std::memory_order_release);
+        return true;
+    }
+    
+    // Consumer side, look at the oldest item without removing it
+    const T* front() const {
+        size_t r = m_read.load(std::memory_order_relaxed);
+        if (r == m_write.load(std::memory_order_acquire)) return nullptr;
+        return &m_items[r & (Capacity - 1)];
+    }
+    
+    // Consumer side, remove the oldest item
+    bool pop(T& item) {
+        const T* oldest = front();
+        if (!oldest) return false;
+        item = *oldest;
+        return pop();
+    }
+    
+    bool pop() {
+        size_t r = m_read.load(std::memory_order_relaxed);
+        if (r == m_write.load(std::memory_order_acquire)) return false;
+        m_read.store(r + 1, std::memory_order_release);
+        return true;
+    }
+    
+    size_t size() const {
+        return m_write.load(std::memory_order_acquire) - m_read.load(std::memory_order_acquire);
+    }
+    
+private:
+    std::array<T, Capacity> m_items;
+    std::atomic<size_t> m_write{0};
+    std::atomic<size_t> m_read{0};
+};
+
+
+// Streaming rational sample rate converter (polyphase windowed sinc), used to run
+// models exported at one sample rate on a host running at another. Each output sample
+// is a dot product of a contiguous history window with one reversed filter phase,
+// written with independent accumulators so the compiler can vectorise it.
+class PolyphaseResampler {
+public:
+    static constexpr size_t k_taps = 32;       // Filter taps per phase (multiple of 8)
+    static constexpr size_t k_max_block = 1024; // Largest input block per process() call
+    
+    PolyphaseResampler() = default;
+    
+    void configure(double in_rate, double out_rate) {
+        long in = std::lround(in_rate);
+        long out = std::lround(out_rate);
+        long divisor = std::gcd(in, out);
+        m_up = std::max(out / divisor, 1L);
+        m_down = std::max(in / divisor, 1L);
+        m_ratio = out_rate / in_rate;
+        
+        // Prototype lowpass at the upsampled rate, cut just below the lower Nyquist
+        size_t length = m_up * k_taps;
+        double cutoff = 0.45 * std::min(in_rate, out_rate) / (in_rate * m_up);
+        double centre = (length - 1) / 2.0;
+        m_coeffs.assign(length, 0.0f);
+        for (size_t i = 0; i < length; ++i) {
+            double x = i - centre;
+            double sinc = x == 0.0 ? 2.0 * cutoff : std::sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+            double window = kaiser(2.0 * i / (length - 1) - 1.0, 8.0);
+            // Reverse each phase so it lines up with a forward history window
+            size_t phase = i % m_up;
+            size_t tap = k_taps - 1 - i / m_up;
+            m_coeffs[phase * k_taps + tap] = static_cast<float>(sinc * window * m_up);
+        }
+        
+        m_history.assign(k_taps - 1 + k_max_block, 0.0f);
+        reset();
+    }
+    
+    void reset() {
+        std::fill(m_history.begin(), m_history.end(), 0.0f);
+        m_position = 0;
+        m_phase = 0;
+    }
+    
+    bool active() const { return m_up != m_down; }
+    double ratio() const { return m_ratio; }
+    
+    // Filter delay in input samples
+    double group_delay() const { return (m_up * k_taps - 1) / (2.0 * m_up); }
+    
+    // Upper bound of the output samples produced for a block of input
+    size_t max_output(size_t count) const { return count * m_up / m_down + 2; }
+    
+    // Convert up to k_max_block input samples, returns the number of samples written
+    template<typename T>
+    size_t process(const T* in, size_t count, float* out) {
+        count = std::min(count, k_max_block);
+        float* fresh = &m_history[k_taps - 1];
+        for (size_t i = 0; i < count; ++i) fresh[i] = static_cast<float>(in[i]);
+        
+        size_t produced = 0;
+        while (m_position < count) {
+            out[produced++] = dot(&m_coeffs[m_phase * k_taps], &m_history[m_position]);
+            m_phase += m_down;
+            m_position += m_phase / m_up;
+            m_phase %= m_up;
+        }
+        
+        // Keep the newest taps-1 samples as history for the next block
+        std::memmove(m_history.data(), &m_history[count], (k_taps - 1) * sizeof(float));
+        m_position -= count;
+        return produced;
+    }
+    
+private:
+    size_t m_up = 1;
+    size_t m_down = 1;
+    double m_ratio = 1.0;
+    std::vector<float> m_coeffs;  // [phase][tap], taps reversed
+    std::vector<float> m_history; // taps-1 samples of history followed by the current block
+    size_t m_position = 0;        // Start of the window for the next output, within the block
+    size_t m_phase = 0;
+    
+    static float dot(const float* coeffs, const float* window) {
+        float acc[8] = {};
+        for (size_t i = 0; i < k_taps; i += 8) {
+            for (size_t j = 0; j < 8; ++j) acc[j] += coeffs[i + j] * window[i + j];
+        }
+        return ((acc[0] + acc[1]) + (acc[2] + acc[3])) + ((acc[4] + acc[5]) + (acc[6] + acc[7]));
+    }
+    
+    static double kaiser(double x, double beta) {
+        return bessel_i0(beta * std::sqrt(std::max(0.0, 1.0 - x * x))) / bessel_i0(beta);
+    }
+    
+    static double bessel_i0(double x) {
+        double sum = 1.0, term = 1.0;
+        for (int k = 1; k < 32; ++k) {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+        return sum;
+    }
+};
+
+
+// Level measurement and conditioning of a chunk before it goes to the model. Both
+// passes are written with independent accumulators, or as plain elementwise loops, so
+// the compiler can vectorise them.
+struct ChunkLevel {
+    float mean = 0.0f;
+    float rms = 0.0f;  // Of the chunk as it goes to the model
+    float peak = 0.0f;
+    
+    static ChunkLevel measure(const float* samples, size_t count) {
+        float sum[8] = {}, squares[8] = {}, peak[8] = {};
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            for (size_t j = 0; j < 8; ++j) {
+                float x = samples[i + j];
+                sum[j] += x;
+                squares[j] += x * x;
+                peak[j] = std::max(peak[j], std::abs(x));
+            }
+        }
+        for (; i < count; ++i) {
+            sum[0] += samples[i];
+            squares[0] += samples[i] * samples[i];
+            peak[0] = std::max(peak[0], std::abs(samples[i]));
+        }
+        
+        ChunkLevel level;
+        if (count == 0) return level;
+        float total = 0.0f, total_squares = 0.0f;
+        for (size_t j = 0; j < 8; ++j) {
+            total += sum[j];
+            total_squares += squares[j];
+            level.peak = std::max(level.peak, peak[j]);
+        }
+        level.mean = total / count;
+        level.rms = std::sqrt(total_squares / count);
+        return level;
+    }
+    
+    // Subtract the chunk's mean and apply a gain in place, keeping the level in step
+    void condition(float* samples, size_t count, bool remove_dc, float gain) {
+        float offset = remove_dc ? mean : 0.0f;
+        if (offset == 0.0f && gain == 1.0f) return;
+        float peaks[8] = {};
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            for (size_t j = 0; j < 8; ++j) {
+                float y = (samples[i + j] - offset) * gain;
+                samples[i + j] = y;
+                peaks[j] = std::max(peaks[j], std::abs(y));
+            }
+        }
+        for (; i < count; ++i) {
+            samples[i] = (samples[i] - offset) * gain;
+            peaks[0] = std::max(peaks[0], std::abs(samples[i]));
+        }
+        
+        // E[(x - o)^2] = E[x^2] - o (2 E[x] - o)
+        rms = std::sqrt(std::max(rms * rms - offset * (2.0f * mean - offset), 0.0f)) * std::abs(gain);
+        mean = (mean - offset) * gain;
+        peak = *std::max_element(peaks, peaks + 8);
+    }
+};
+
+
+// Scheduling controls for the calling thread, so inference can be kept off the cores
+// that run audio I/O. Every call returns false with a reason when the OS refuses.
+class ThreadControl {
+public:
+    enum class Priority { normal, high, realtime, enum_count };
+    
+    // Restrict the calling thread to the cores set in a bitmask (0 for any core). macOS
+    // has no pinning, threads sharing a non-zero affinity tag are kept on the same L2.
+    static bool set_affinity(uint64_t cores, std::string& error);
+    
+    // Raise the calling thread's priority. The real-time class is given a period of
+    // one chunk of audio, which only macOS' time constraint policy makes use of.
+    static bool set_priority(Priority priority, double period_seconds, std::string& error);
+    
+    // libtorch's inter-op pool is process-wide and can only be sized before it starts
+    static bool set_interop_threads(int threads, std::string& error);
+    
+private:
+    static int first_core(uint64_t cores);
+};
+
+
+// Model outputs for one analysed chunk
+struct PitchResult {
+    float pitch = 0.0f;
+    float confidence = 0.0f;
+    float amplitude = 0.0f;
+};
+
+
+// One streaming instance of a model in an inference engine, with its own state. Callers
+// write {batch, chunk} samples through input() and run() writes one result per row.
+// run() throws std::exception subclasses (c10::Error, Ort::Exception), and
+// std::runtime_error if the model's outputs don't match the batch.
+class SessionBackend {
+public:
+    virtual ~SessionBackend() = default;
+    virtual float* input(size_t row) = 0;
+    virtual void run(PitchResult* results, int batch_size) = 0;
+    
+    // Remember the current streaming state, and return to the remembered state
+    virtual void capture() = 0;
+    virtual void reset() = 0;
+    
+    // The same for a single row of a batch: return it to the remembered state, or leave
+    // it out of a run by saving the state before the run and restoring the row after it.
+    // State without a batch dimension is shared by every row and left as it is.
+    virtual void reset_row(size_t row) = 0;
+    virtual void save_state() = 0;
+    virtual void restore_row(size_t row) = 0;
+    
+    // Copy one row of another session of the same model into a row of this one, to carry
+    // a stream over to a session with another batch size. Shared state isn't copied.
+    virtual void copy_row(const SessionBackend& from, size_t from_row, size_t row) = 0;
+    
+    // Pitch activations of the last run, {batch, bins}, for models that return them after
+    // pitch, confidence and amplitude. Only read out while kept, nullptr otherwise.
+    virtual void keep_activations(bool keep) {}
+    virtual const float* activations(size_t row) const { return nullptr; }
+    virtual int activation_bins() const { return 0; }
+};
+
+
+// Visit the streaming state of a TorchScript module: every attribute of every submodule
+// that is neither a parameter nor a submodule (caches, counters, flags)
+template <typename Visitor>
+void for_each_state_slot(const torch::jit::script::Module& module, Visitor&& visit) {
+    for (const auto& submodule : module.modules()) {
+        auto object = submodule._ivalue();
+        auto type = submodule.type();
+        for (size_t i = 0; i < type->numAttributes(); ++i) {
+            if (type->is_parameter(i) || type->getAttribute(i)->is_module()) continue;
+            visit(object, i);
+        }
+    }
+}
+
+
+// A TorchScript module instance prepared for allocation-free streaming inference. The
+// {B, chunk} input tensor and the interpreter stack are allocated once per model load,
+// callers write samples straight into the tensor's storage through input(), and forward
+// is invoked on the stack directly so no argument vector is built per call. On a GPU, or
+// for half precision models, the input is written to a float staging tensor (pinned
+// for CUDA) and copied to the model's device and dtype per run. Resets call the model's
+// own reset() method when it exports one, and otherwise copy a snapshot of the state
+// attributes back in place.
+class TorchSession : public SessionBackend {
+public:
+    TorchSession(torch::jit::script::Module module, int chunk_size, int batch_size,
+                 torch::Device device, torch::ScalarType dtype)
+        : m_module(std::move(module)), m_chunk_size(chunk_size), m_batch_size(batch_size) {
+        auto options = torch::TensorOptions().dtype(torch::kFloat32);
+        if (device.type() == torch::kCUDA) options = options.pinned_memory(true);
+        m_input = torch::zeros({(int64_t)batch_size, (int64_t)chunk_size}, options);
+        m_input_data = m_input.data_ptr<float>();
+        if (!device.is_cpu() || dtype != torch::kFloat32) {
+            m_device_input = torch::zeros({(int64_t)batch_size, (int64_t)chunk_size}, torch::TensorOptions().dtype(dtype).device(device));
+        }
+        m_forward = &m_module.get_method("forward").function();
+        if (auto reset = m_module.find_method("reset"); reset && reset->function().num_inputs() == 1) {
+            m_reset = &reset->function();
+        }
+        m_stack.reserve(4);
+        capture();
+    }
+    
+    float* input(size_t row) override { return m_input_data + row * m_chunk_size; }
+    
+    void run(PitchResult* results, int batch_size) override {
+        m_stack.clear();
+        m_stack.emplace_back(m_module._ivalue());
+        if (m_device_input.defined()) {
+            m_device_input.copy_(m_input, /*non_blocking=*/true);
+            m_stack.emplace_back(m_device_input);
+        } else {
+            m_stack.emplace_back(m_input);
+        }
+        m_forward->run(m_stack);
+        
+        auto output_tuple = m_stack.back().toTuple();
+        const auto& elements = output_tuple->elements();
+        const float* outputs[3];
+        for (int i = 0; i < 3; ++i) {
+            m_outputs[i] = elements[i].toTensor();
+            if (!m_outputs[i].device().is_cpu()) {
+                m_outputs[i] = m_outputs[i].to(torch::kCPU, torch::kFloat32);
+            }
+            if (m_outputs[i].scalar_type() != torch::kFloat32 || !m_outputs[i].is_contiguous()) {
+                m_outputs[i] = m_outputs[i].to(torch::kFloat32).contiguous();
+            }
+            if (m_outputs[i].numel() != batch_size) {
+                throw std::runtime_error("model does not support batched input");
+            }
+            outputs[i] = m_outputs[i].data_ptr<float>();
+        }
+        
+        for (int row = 0; row < batch_size; ++row) {
+            results[row].pitch = outputs[0][row];
+            results[row].confidence = outputs[1][row];
+            results[row].amplitude = outputs[2][row];
+        }
+        
+        m_activation_bins = 0;
+        if (m_keep_activations && elements.size() > 3 && elements[3].isTensor()) {
+            torch::Tensor& activations = m_outputs[3];
+            activations = elements[3].toTensor();
+            if (!activations.device().is_cpu()) {
+                activations = activations.to(torch::kCPU, torch::kFloat32);
+            }
+            if (activations.scalar_type() != torch::kFloat32 || !activations.is_contiguous()) {
+                activations = activations.to(torch::kFloat32).contiguous();
+            }
+            if (activations.numel() > 0 && activations.numel() % batch_size == 0) {
+                m_activation_bins = static_cast<int>(activations.numel() / batch_size);
+                m_activation_data = activations.data_ptr<float>();
+            }
+        }
+    }
+    
+    void keep_activations(bool keep) override { m_keep_activations = keep; }
+    
+    const float* activations(size_t row) const override {
+        return m_activation_bins > 0 ? m_activation_data + row * m_activation_bins : nullptr;
+    }
+    
+    int activation_bins() const override { return m_activation_bins; }
+    
+    // Also taken for models with their own reset(), which can only reset every row
+    void capture() override {
+        m_state.clear();
+        m_saved.clear();
+        for_each_state_slot(m_module, [this](const auto& object, size_t i) {
+            torch::jit::IValue slot = object->getSlot(i);
+            m_state.push_back({ object, i, slot.isTensor() ? torch::jit::IValue(slot.toTensor().clone()) : slot.deepcopy() });
+            m_saved.push_back({ object, i, slot.isTensor() ? torch::jit::IValue(slot.toTensor().clone()) : slot.deepcopy() });
+        });
+    }
+    
+    // Tensors that kept their shape are overwritten in place, so a reset doesn't allocate
+    void reset() override {
+        if (m_reset) {
+            m_stack.clear();
+            m_stack.emplace_back(m_module._ivalue());
+            m_reset->run(m_stack);
+            return;
+        }
+        for (const auto& saved : m_state) restore_slot(saved);
+    }
+    
+    void reset_row(size_t row) override {
+        for (const auto& saved : m_state) restore_slot(saved, row);
+    }
+    
+    void save_state() override {
+        for (size_t k = 0; k < m_saved.size(); ++k) {
+            torch::jit::IValue current = m_saved[k].object->getSlot(m_saved[k].slot);
+            torch::jit::IValue& saved = m_saved[k].value;
+            if (same_tensor(saved, current)) {
+                saved.toTensor().copy_(current.toTensor());
+            } else {
+                saved = current.isTensor() ? torch::jit::IValue(current.toTensor().clone()) : current.deepcopy();
+            }
+        }
+    }
+    
+    void restore_row(size_t row) override {
+        for (const auto& saved : m_saved) restore_slot(saved, row);
+    }
+    
+    void copy_row(const SessionBackend& from, size_t from_row, size_t row) override {
+        auto* other = dynamic_cast<const TorchSession*>(&from);
+        if (!other || other->m_state.size() != m_state.size()) return;
+        for (size_t k = 0; k < m_state.size(); ++k) {
+            torch::jit::IValue source = other->m_state[k].object->getSlot(other->m_state[k].slot);
+            torch::jit::IValue target = m_state[k].object->getSlot(m_state[k].slot);
+            if (!source.isTensor() || !target.isTensor()) continue;
+            const auto& a = source.toTensor();
+            auto b = target.toTensor();
+            if (a.dim() == 0 || a.dim() != b.dim() || a.size(0) != other->m_batch_size || b.size(0) != m_batch_size
+                || a.scalar_type() != b.scalar_type() || a.select(0, 0).sizes() != b.select(0, 0).sizes()) continue;
+            b.select(0, (int64_t)row).copy_(a.select(0, (int64_t)from_row));
+        }
+    }
+    
+private:
+    torch::jit::script::Module m_module;
+    int m_chunk_size;
+    int m_batch_size;
+    torch::Tensor m_input;
+    torch::Tensor m_device_input; // Undefined for float models on the CPU
+    float* m_input_data = nullptr;
+    torch::jit::Function* m_forward = nullptr;
+    torch::jit::Function* m_reset = nullptr; // The model's reset(), if it exports one
+    torch::jit::Stack m_stack;
+    torch::Tensor m_outputs[4]; // Keeps output storage alive while results are read
+    bool m_keep_activations = false;
+    const float* m_activation_data = nullptr;
+    int m_activation_bins = 0;  // 0 when the last run returned no activations
+    
+    struct StateSlot {
+        c10::intrusive_ptr<torch::jit::Object> object;
+        size_t slot;
+        torch::jit::IValue value;
+    };
+    std::vector<StateSlot> m_state; // Snapshot reset() returns to without a model reset()
+    std::vector<StateSlot> m_saved; // State before a run, for the rows left out of it
+    
+    static bool same_tensor(const torch::jit::IValue& a, const torch::jit::IValue& b) {
+        return a.isTensor() && b.isTensor() && a.toTensor().sizes() == b.toTensor().sizes()
+            && a.toTensor().scalar_type() == b.toTensor().scalar_type();
+    }
+    
+    // Copy a saved slot back, all of it or one row of dimension 0
+    void restore_slot(const StateSlot& saved, std::optional<size_t> row = std::nullopt) {
+        torch::jit::IValue current = saved.object->getSlot(saved.slot);
+        if (row && m_batch_size > 1) {
+            if (same_tensor(saved.value, current) && current.toTensor().dim() > 0 && current.toTensor().size(0) == m_batch_size) {
+                current.toTensor().select(0, (int64_t)*row).copy_(saved.value.toTensor().select(0, (int64_t)*row));
+            }
+        } else if (same_tensor(saved.value, current)) {
+            current.toTensor().copy_(saved.value.toTensor());
+        } else {
+            saved.object->setSlot(saved.slot, saved.value.isTensor() ? torch::jit::IValue(saved.value.toTensor().clone()) : saved.value.deepcopy());
+        }
+    }
+};
+
+
+#ifdef PESTO_WITH_ONNXRUNTIME
+// An ONNX Runtime session shared by every instance of a model. ONNX graphs carry no
+// state, so streaming models are exported with the audio chunk as the first input,
+// pitch, confidence and amplitude as the first three outputs, and one extra input and
+// output per state tensor, in the same order. Run() may be called from several
+// threads at once, each instance keeping its own state tensors.
+class OnnxModel {
+public:
+    OnnxModel(const fs::path& path, torch::Device device)
+        : m_session(create(path, device)) {
+        Ort::AllocatorWithDefaultOptions allocator;
+        for (size_t i = 0; i < m_session.GetInputCount(); ++i) {
+            m_input_names.push_back(m_session.GetInputNameAllocated(i, allocator).get());
+            auto info = m_session.GetInputTypeInfo(i).GetTensorTypeAndShapeInfo();
+            if (info.GetElementType() != ONNX_TENSOR_ELEMENT_DATA_TYPE_FLOAT) {
+                throw std::runtime_error("ONNX model input " + m_input_names.back() + " is not float32");
+            }
+            if (i > 0) m_state_shapes.push_back(info.GetShape());
+        }
+        for (size_t i = 0; i < m_session.GetOutputCount(); ++i) {
+            m_output_names.push_back(m_session.GetOutputNameAllocated(i, allocator).get());
+        }
+        if (m_input_names.empty() || m_output_names.size() != 3 + m_state_shapes.size()) {
+            throw std::runtime_error("ONNX model needs an audio input, three result outputs and one output per state input");
+        }
+        for (const auto& name : m_input_names) m_input_pointers.push_back(name.c_str());
+        for (const auto& name : m_output_names) m_output_pointers.push_back(name.c_str());
+    }
+    
+    Ort::Session& session() const { return m_session; }
+    const std::vector<std::vector<int64_t>>& state_shapes() const { return m_state_shapes; }
+    const char* const* input_names() const { return m_input_pointers.data(); }
+    const char* const* output_names() const { return m_output_pointers.data(); }
+    
+private:
+    mutable Ort::Session m_session;
+    std::vector<std::string> m_input_names, m_output_names;
+    std::vector<const char*> m_input_pointers, m_output_pointers;
+    std::vector<std::vector<int64_t>> m_state_shapes; // Dynamic dimensions are -1
+    
+    static Ort::Env& environment() {
+        static Ort::Env env(ORT_LOGGING_LEVEL_WARNING, "pesto~");
+        return env;
+    }
+    
+    // One thread per run: the model is tiny and instances already run in parallel
+    static Ort::Session create(const fs::path& path, torch::Device device) {
+        Ort::SessionOptions options;
+        options.SetIntraOpNumThreads(1);
+        options.SetInterOpNumThreads(1);
+        options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+#if defined(__APPLE__) && defined(PESTO_ONNX_COREML)
+        if (device.type() == torch::kMPS) {
+            Ort::ThrowOnError(OrtSessionOptionsAppendExecutionProvider_CoreML(options, 0));
+        }
+#endif
+#if defined(_WIN32) && defined(PESTO_ONNX_DIRECTML)
+        if (device.type() == torch::kCUDA) {
+            options.DisableMemPattern();
+            options.SetExecutionMode(ExecutionMode::ORT_SEQUENTIAL);
+            Ort::ThrowOnError(OrtSessionOptionsAppendExecutionProvider_DML(options, 0));
+        }
+#endif
+        return Ort::Session(environment(), path.native().c_str(), options);
+    }
+};
+
+
+// Streaming instance of an ONNX model. Input, result and state tensors wrap buffers
+// allocated here once, and two sets of state buffers are swapped after every run, so
+// neither run() nor reset() allocates.
+class OnnxSession : public SessionBackend {
+public:
+    OnnxSession(std::shared_ptr<const OnnxModel> model, int chunk_size, int batch_size)
+        : m_model(std::move(model)), m_chunk_size(chunk_size), m_batch_size(batch_size) {
+        auto memory = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeDefault);
+        m_audio.assign(size_t(batch_size) * chunk_size, 0.0f);
+        for (auto& result : m_results) result.assign(batch_size, 0.0f);
+        
+        const auto& shapes = m_model->state_shapes();
+        for (int set = 0; set < 2; ++set) m_states[set].resize(shapes.size());
+        for (size_t i = 0; i < shapes.size(); ++i) {
+            m_state_shapes.push_back(resolve(shapes[i], batch_size));
+            size_t count = std::accumulate(m_state_shapes[i].begin(), m_state_shapes[i].end(), size_t(1), std::multiplies<size_t>());
+            for (int set = 0; set < 2; ++set) m_states[set][i].assign(count, 0.0f);
+            m_row_layouts.push_back(row_layout(shapes[i], m_state_shapes[i], batch_size));
+        }
+        m_initial_state = m_states[0];
+        m_saved_state = m_states[0];
+        
+        // Run set k reads state set k and writes state set 1 - k
+        int64_t audio_shape[2] = { batch_size, chunk_size };
+        int64_t result_shape[1] = { batch_size };
+        for (int set = 0; set < 2; ++set) {
+            m_inputs[set].push_back(Ort::Value::CreateTensor<float>(memory, m_audio.data(), m_audio.size(), audio_shape, 2));
+            for (auto& result : m_results) {
+                m_outputs[set].push_back(Ort::Value::CreateTensor<float>(memory, result.data(), result.size(), result_shape, 1));
+            }
+            for (size_t i = 0; i < shapes.size(); ++i) {
+                auto& read = m_states[set][i];
+                auto& write = m_states[1 - set][i];
+                m_inputs[set].push_back(Ort::Value::CreateTensor<float>(memory, read.data(), read.size(), m_state_shapes[i].data(), m_state_shapes[i].size()));
+                m_outputs[set].push_back(Ort::Value::CreateTensor<float>(memory, write.data(), write.size(), m_state_shapes[i].data(), m_state_shapes[i].size()));
+            }
+        }
+    }
+    
+    float* input(size_t row) override { return m_audio.data() + row * m_chunk_size; }
+    
+    void run(PitchResult* results, int batch_size) override {
+        m_model->session().Run(m_run_options, m_model->input_names(), m_inputs[m_set].data(), m_inputs[m_set].size(),
+                               m_model->output_names(), m_outputs[m_set].data(), m_outputs[m_set].size());
+        m_set = 1 - m_set;
+        for (int row = 0; row < batch_size; ++row) {
+            results[row].pitch = m_results[0][row];
+            results[row].confidence = m_results[1][row];
+            results[row].amplitude = m_results[2][row];
+        }
+    }
+    
+    void capture() override {
+        for (size_t i = 0; i < m_initial_state.size(); ++i) {
+            std::copy(m_states[m_set][i].begin(), m_states[m_set][i].end(), m_initial_state[i].begin());
+        }
+    }
+    
+    void reset() override {
+        for (size_t i = 0; i < m_initial_state.size(); ++i) {
+            std::copy(m_initial_state[i].begin(), m_initial_state[i].end(), m_states[m_set][i].begin());
+        }
+    }
+    
+    void reset_row(size_t row) override {
+        for (size_t i = 0; i < m_initial_state.size(); ++i) copy_row(m_initial_state[i], m_states[m_set][i], m_row_layouts[i], row);
+    }
+    
+    void save_state() override {
+        for (size_t i = 0; i < m_saved_state.size(); ++i) {
+            std::copy(m_states[m_set][i].begin(), m_states[m_set][i].end(), m_saved_state[i].begin());
+        }
+    }
+    
+    void restore_row(size_t row) override {
+        for (size_t i = 0; i < m_saved_state.size(); ++i) copy_row(m_saved_state[i], m_states[m_set][i], m_row_layouts[i], row);
+    }
+    
+    void copy_row(const SessionBackend& from, size_t from_row, size_t row) override {
+        auto* other = dynamic_cast<const OnnxSession*>(&from);
+        if (!other || other->m_row_layouts.size() != m_row_layouts.size()) return;
+        for (size_t i = 0; i < m_row_layouts.size(); ++i) {
+            const RowLayout& source = other->m_row_layouts[i];
+            const RowLayout& target = m_row_layouts[i];
+            if (source.outer != target.outer || source.inner != target.inner || target.inner == 0) continue;
+            const auto& read = other->m_states[other->m_set][i];
+            auto& write = m_states[m_set][i];
+            for (size_t outer = 0; outer < target.outer; ++outer) {
+                std::copy_n(read.begin() + (outer * other->m_batch_size + from_row) * target.inner, target.inner,
+                            write.begin() + (outer * m_batch_size + row) * target.inner);
+            }
+        }
+    }
+    
+private:
+    // A state tensor seen as {outer, batch, inner} around its batch dimension,
+    // with inner 0 when it has none
+    struct RowLayout {
+        size_t outer = 1;
+        size_t inner = 0;
+    };
+    
+
+    std::shared_ptr<const OnnxModel> m_model;
+    int m_chunk_size;
+    int m_batch_size;
+    Ort::RunOptions m_run_options;
+    std::vector<float> m_audio;
+    std::vector<float> m_results[3];
+    std::vector<std::vector<float>> m_states[2];
+    std::vector<std::vector<float>> m_initial_state; // Returned to by reset()
+    std::vector<std::vector<float>> m_saved_state;   // State before a run, for the rows left out of it
+    std::vector<std::vector<int64_t>> m_state_shapes;
+    std::vector<RowLayout> m_row_layouts;
+    std::vector<Ort::Value> m_inputs[2], m_outputs[2];
+    int m_set = 0;
+    
+    // The first dynamic dimension is the batch, any other becomes 1
+    static std::vector<int64_t> resolve(std::vector<int64_t> shape, int batch_size) {
+        bool batch_seen = false;
+        for (auto& dim : shape) {
+            if (dim >= 0) continue;
+            dim = batch_seen ? 1 : batch_size;
+            batch_seen = true;
+        }
+        return shape;
+    }
+    
+    static RowLayout row_layout(const std::vector<int64_t>& shape, const std::vector<int64_t>& resolved, int batch_size) {
+        RowLayout layout;
+        auto batch = std::find_if(shape.begin(), shape.end(), [](int64_t dim) { return dim < 0; });
+        if (batch == shape.end()) {
+            if (batch_size == 1) layout.inner = std::accumulate(resolved.begin(), resolved.end(), size_t(1), std::multiplies<size_t>());
+            return layout;
+        }
+        size_t index = batch - shape.begin();
+        layout.outer = std::accumulate(resolved.begin(), resolved.begin() + index, size_t(1), std::multiplies<size_t>());
+        layout.inner = std::accumulate(resolved.begin() + index + 1, resolved.end(), size_t(1), std::multiplies<size_t>());
+        return layout;
+    }
+    
+    void copy_row(const std::vector<float>& from, std::vector<float>& to, const RowLayout& layout, size_t row) const {
+        for (size_t outer = 0; outer < layout.outer && layout.inner > 0; ++outer) {
+            size_t offset = (outer * m_batch_size + row) * layout.inner;
+            std::copy_n(from.begin() + offset, layout.inner, to.begin() + offset);
+        }
+    }
+};
+#endif
+
+
+// A read-only view of a whole file. Every process that maps the same file shares its
+// physical pages, which are only read from disk when they are first touched.
+class MappedFile {
+public:
+    // Throws std::runtime_error if the file can't be opened or mapped
+    explicit MappedFile(const fs::path& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const unsigned char* data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+private:
+    const unsigned char* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+
+// Serves TorchScript's archive reader straight from a mapped model file, instead of
+// streaming the file through private read buffers
+class MappedReadAdapter : public caffe2::serialize::ReadAdapterInterface {
+public:
+    explicit MappedReadAdapter(std::shared_ptr<const MappedFile> file) : m_file(std::move(file)) {}
+
+    size_t size() const override { return m_file->size(); }
+
+    size_t read(uint64_t pos, void* buf, size_t n, const char* what = "") const override {
+        if (pos >= m_file->size()) return 0;
+        n = std::min<size_t>(n, m_file->size() - pos);
+        std::memcpy(buf, m_file->data() + pos, n);
+        return n;
+    }
+
+private:
+    std::shared_ptr<const MappedFile> m_file;
+};
+
+
+// Flat weight files that let every instance and process running a model share one copy
+// of its parameters in physical memory. The first load of a model file writes its dense
+// parameters and buffers to a blob in a directory private to the user, named after the
+// model's path and modification time; every load then points the module's tensors at a
+// read-only mapping of the blob, which stays mapped for as long as any of them is alive.
+// A blob is only used when the user owns it and it was written from the same file (path,
+// modification time and size); its contents are checked against the model's tensors once,
+// when it is written. Loading still parses the whole .pt file, so this saves memory, not
+// load time. Instances keep private copies of the buffers, since forward may update them,
+// so only the parameters end up shared. Quantized and packed weights stay private, and
+// so do weights on a GPU.
+class SharedWeights {
+public:
+    // Returns false with a reason when the module's weights stay in private memory
+    static bool share(torch::jit::script::Module& module, const fs::path& model_path, std::string& error);
+
+    // Where the blob of a model file lives, empty with a reason when the user's blob
+    // directory isn't private
+    static fs::path blob_path(const fs::path& model_path, std::string& error);
+};
+
+
+// Process-wide cache of loaded models, shared by every pesto~ instance. Entries are
+// keyed by canonical path and modification time, and live for as long as at least one
+// instance holds them, so loading an already open model is almost free. The inference
+// engine is chosen by file extension: TorchScript for .pt, ONNX Runtime for .onnx.
+class ModelCache {
+public:
+    // A loaded model that sessions with private streaming state are created from
+    class Entry {
+    public:
+        Entry(std::string key, std::string path, torch::Device device, torch::ScalarType dtype)
+            : m_key(std::move(key)), m_path(std::move(path)), m_device(device), m_dtype(dtype) {}
+        virtual ~Entry() = default;
+
+        const std::string& key() const { return m_key; }
+        const std::string& path() const { return m_path; }
+        torch::Device device() const { return m_device; }
+        torch::ScalarType input_dtype() const { return m_dtype; } // Half precision models take half input
+        
+        // Why the model was loaded differently than asked for, empty if it wasn't
+        const std::string& warning() const { return m_warning; }
+        
+        virtual std::unique_ptr<SessionBackend> create_session(int chunk_size, int batch_size) const = 0;
+
+    protected:
+        std::string m_warning;
+
+    private:
+        std::string m_key;
+        std::string m_path;
+        torch::Device m_device;
+        torch::ScalarType m_dtype;
+    };
+    
+    // A TorchScript model whose prototype module is never run directly
+    class TorchEntry : public Entry {
+    public:
+        TorchEntry(std::string key, std::string path, torch::jit::script::Module prototype, torch::Device device, torch::ScalarType dtype,
+                   std::string warning = {})
+            : Entry(std::move(key), std::move(path), device, dtype), m_prototype(std::move(prototype)) {
+            m_warning = std::move(warning);
+        }
+        
+        // Create a module that shares the prototype's parameters but owns a private
+        // copy of every other attribute (streaming caches, counters, flags). Instances are
+        // objects of the prototype's own class types, so nothing is registered with the
+        // shared compilation unit and any thread may create them.
+        torch::jit::script::Module instantiate() const {
+            torch::jit::script::Module module(copy_objects(m_prototype._ivalue()));
+            for_each_state_slot(module, [](const auto& object, size_t i) {
+                torch::jit::IValue slot = object->getSlot(i);
+                if (slot.isTensor()) {
+                    object->setSlot(i, slot.toTensor().clone());
+                } else {
+                    object->setSlot(i, slot.deepcopy());
+                }
+            });
+            return module;
+        }
+        
+        std::unique_ptr<SessionBackend> create_session(int chunk_size, int batch_size) const override {
+            return std::make_unique<TorchSession>(instantiate(), chunk_size, batch_size, device(), input_dtype());
+        }
+        
+    private:
+        torch::jit::script::Module m_prototype;
+        
+        // Shallow copy of a module object and of each of its submodules, slots aliased
+        static torch::jit::ObjectPtr copy_objects(const torch::jit::ObjectPtr& prototype) {
+            torch::jit::ObjectPtr object = prototype->copy();
+            auto type = object->type();
+            for (size_t i = 0; i < type->numAttributes(); ++i) {
+                if (type->getAttribute(i)->is_module()) {
+                    object->setSlot(i, copy_objects(object->getSlot(i).toObject()));
+                }
+            }
+            return object;
+        }
+    };
+    
+#ifdef PESTO_WITH_ONNXRUNTIME
+    class OnnxEntry : public Entry {
+    public:
+        OnnxEntry(std::string key, std::string path, torch::Device device)
+            : Entry(std::move(key), path, device, torch::kFloat32), m_model(std::make_shared<const OnnxModel>(path, device)) {}
+        
+        std::unique_ptr<SessionBackend> create_session(int chunk_size, int batch_size) const override {
+            return std::make_unique<OnnxSession>(m_model, chunk_size, batch_size);
+        }
+        
+    private:
+        std::shared_ptr<const OnnxModel> m_model;
+    };
+#endif
+
+    // Whether this build can load a model file's format
+    static bool supports(const fs::path& model_path) {
+        if (model_path.extension() == ".pt") return true;
+#ifdef PESTO_WITH_ONNXRUNTIME
+        if (model_path.extension() == ".onnx") return true;
+#endif
+        return false;
+    }
+
+    // Return the shared entry for a model file, loading it if no instance holds it yet.
+    // Optimized entries are frozen and run through the inference passes once at load,
+    // and every device gets its own copy of the weights, so both are part of the key.
+    // Mapped entries are read from a memory-mapped file and keep their weights in a
+    // SharedWeights blob. A model that can't be optimized or shared is kept as loaded,
+    // with the reason in warning().
+    // Throws c10::Error, Ort::Exception, fs::filesystem_error or std::runtime_error if
+    // the file cannot be loaded.
+    static std::shared_ptr<const Entry> acquire(const std::string& model_path, bool optimize = false,
+                                                torch::Device device = torch::kCPU, torch::ScalarType dtype = torch::kFloat32,
+                                                bool mapped = false);
+
+private:
+    struct Slot {
+        std::mutex mutex;
+        std::weak_ptr<const Entry> entry;
+    };
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::shared_ptr<Slot>> m_slots;
+
+    static ModelCache& instance();
+
+    // Drop slots of released models that nobody is currently loading
+    void purge() {
+        for (auto it = m_slots.begin(); it != m_slots.end();) {
+            if (it->second.use_count() == 1 && it->second->entry.expired()) {
+                it = m_slots.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+};
+
+
+// Process-wide index of the model files in the models directories, shared by every
+// pesto~ instance. Filenames are parsed once per scan, and a directory is only listed
+// again when its modification time changes (a file was added, removed or renamed) or
+// a rescan is forced, so a load costs a stat per directory and hash lookups.
+class ModelIndex {
+public:
+    struct ModelFile {
+        std::string filename;
+        std::string path;
+        int rate_tag = 0;               // Sample rate tag in kHz (sr44k), 0 if untagged
+        int chunk_size = 0;             // Chunk size tag (h512), 0 if untagged
+        std::string precision = "fp32"; // Precision tag, models without one are fp32
+    };
+    
+    // An immutable listing, safe to keep and read while the index is rescanned
+    class Snapshot {
+    public:
+        const std::vector<ModelFile>& files() const { return m_files; }
+        
+        // The file in the first directory that has it, nullptr if none
+        const ModelFile* find(const std::string& filename) const {
+            auto it = m_by_name.find(filename);
+            return it == m_by_name.end() ? nullptr : &m_files[it->second];
+        }
+        
+        // Indices into files() of every model with a chunk size
+        const std::vector<size_t>& with_chunk(int chunk_size) const {
+            static const std::vector<size_t> none;
+            auto it = m_by_chunk.find(chunk_size);
+            return it == m_by_chunk.end() ? none : it->second;
+        }
+        
+    private:
+        friend class ModelIndex;
+        std::vector<ModelFile> m_files;
+        std::unordered_map<std::string, size_t> m_by_name;
+        std::unordered_map<int, std::vector<size_t>> m_by_chunk;
+    };
+    
+    // The current listing of the directories, scanning them first if they changed
+    static std::shared_ptr<const Snapshot> snapshot(const std::vector<std::string>& directories, bool rescan = false);
+    
+    // Parse the sample rate, chunk size and precision tags of a filename
+    static ModelFile parse(const fs::path& file);
+    
+    // Sample rate of a kHz tag, the 44.1kHz family is tagged by its integer part
+    static double rate_from_tag(int khz) {
+        switch (khz) {
+            case 11: return 11025.0;
+            case 22: return 22050.0;
+            case 44: return 44100.0;
+            case 88: return 88200.0;
+            case 176: return 176400.0;
+            default: return khz * 1000.0;
+        }
+    }
+    
+    static torch::ScalarType precision_dtype(const std::string& precision) {
+        if (precision == "fp16") return torch::kFloat16;
+        if (precision == "bf16") return torch::kBFloat16;
+        return torch::kFloat32; // Dynamically quantized int8 models take float input
+    }
+    
+private:
+    using Stamp = fs::file_time_type;
+    
+    std::mutex m_mutex;
+    std::shared_ptr<const Snapshot> m_snapshot;
+    std::vector<std::string> m_directories;
+    std::vector<Stamp> m_stamps;
+    
+    static ModelIndex& instance();
+    static std::vector<Stamp> stamp(const std::vector<std::string>& directories);
+    static std::shared_ptr<const Snapshot> scan(const std::vector<std::string>& directories);
+};
+
+
+// A streaming instance of a cached model, in whichever engine the model was loaded
+// with. Everything a run needs is allocated when the session is created, once per
+// model load, and callers write samples straight into the engine's input buffer.
+class ModelSession {
+public:
+    ModelSession() = default;
+    
+    ModelSession(const ModelCache::Entry& model, int chunk_size, int batch_size = 1)
+        : m_backend(model.create_session(chunk_size, batch_size)), m_chunk_size(chunk_size), m_batch_size(batch_size) {}
+    
+    bool valid() const { return m_backend != nullptr; }
+    int chunk_size() const { return m_chunk_size; }
+    int batch_size() const { return m_batch_size; }
+    
+    // Input samples for one row of the batch
+    float* input(size_t row = 0) { return m_backend->input(row); }
+    
+    // Run forward on the current input and write one result per row.
+    // Throws the engine's exceptions, or std::runtime_error if the outputs don't match the batch.
+    void run(PitchResult* results) {
+        m_backend->run(results, m_batch_size);
+    }
+    
+    // Make the current streaming state the one reset() returns to. Sessions start out
+    // with the model's initial state captured.
+    void capture() { m_backend->capture(); }
+    
+    // Return every row to the captured state with a copy, no forward passes
+    void reset() { m_backend->reset(); }
+    
+    // Return one row to the captured state, and leave rows out of a run by saving the
+    // state before it and restoring those rows after it, see SessionBackend
+    void reset_row(size_t row) { m_backend->reset_row(row); }
+    void save_state() { m_backend->save_state(); }
+    void restore_row(size_t row) { m_backend->restore_row(row); }
+    
+    // Carry one row of another session of the same model over into a row of this one
+    void copy_row(const ModelSession& from, size_t from_row, size_t row) { m_backend->copy_row(*from.m_backend, from_row, row); }
+    
+    // Read out the model's pitch activations on the following runs, see SessionBackend
+    void keep_activations(bool keep) { m_backend->keep_activations(keep); }
+    const float* activations(size_t row = 0) const { return m_backend->activations(row); }
+    int activation_bins() const { return m_backend->activation_bins(); }
+    
+private:
+    std::unique_ptr<SessionBackend> m_backend;
+    int m_chunk_size = 0;
+    int m_batch_size = 0;
+};
+
+
+// One chunk per input channel, run as a single batched forward with a row of streaming
+// state per channel. Models whose state can't take a batch dimension are split into one
+// session per channel the first time the batched forward fails.
+class ChannelSession {
+public:
+    ChannelSession(std::shared_ptr<const ModelCache::Entry> model, int chunk_size, int channels)
+        : m_model(std::move(model)), m_chunk_size(chunk_size), m_channels(channels) {
+        if (channels > 1) {
+            m_batch = ModelSession(*m_model, chunk_size, channels);
+        } else {
+            m_rows.emplace_back(*m_model, chunk_size);
+        }
+    }
+    
+    int channel_count() const { return m_channels; }
+    bool batched() const { return m_batch.valid(); }
+    const std::string& fallback_reason() const { return m_fallback_reason; }
+    
+    float* input(size_t channel) {
+        return batched() ? m_batch.input(channel) : m_rows[channel].input();
+    }
+    
+    // Run every channel and write one result per channel
+    void run(PitchResult* results) {
+        if (batched()) {
+            try {
+                m_batch.run(results);
+                return;
+            }
+            catch (const std::exception& e) {
+                split(e.what());
+            }
+        }
+        for (int channel = 0; channel < m_channels; ++channel) {
+            m_rows[channel].run(&results[channel]);
+        }
+    }
+    
+    void capture() {
+        if (batched()) m_batch.capture();
+        for (auto& row : m_rows) row.capture();
+    }
+    
+    void reset() {
+        if (batched()) m_batch.reset();
+        for (auto& row : m_rows) row.reset();
+    }
+    
+    void keep_activations(bool keep) {
+        if (keep == m_keep_activations) return;
+        m_keep_activations = keep;
+        if (batched()) m_batch.keep_activations(keep);
+        for (auto& row : m_rows) row.keep_activations(keep);
+    }
+    
+    // Activations of a channel from the last run, nullptr if not kept or not returned
+    const float* activations(size_t channel) const {
+        return batched() ? m_batch.activations(channel) : m_rows[channel].activations();
+    }
+    
+    int activation_bins(size_t channel) const {
+        return batched() ? m_batch.activation_bins() : m_rows[channel].activation_bins();
+    }
+    
+private:
+    std::shared_ptr<const ModelCache::Entry> m_model;
+    int m_chunk_size;
+    int m_channels;
+    ModelSession m_batch;
+    std::vector<ModelSession> m_rows;
+    std::string m_fallback_reason;
+    bool m_keep_activations = false;
+    
+    void split(const std::string& reason) {
+        m_fallback_reason = reason;
+        for (int channel = 0; channel < m_channels; ++channel) {
+            m_rows.emplace_back(*m_model, m_chunk_size);
+            m_rows.back().keep_activations(m_keep_activations);
+            std::memcpy(m_rows.back().input(), m_batch.input(channel), m_chunk_size * sizeof(float));
+        }
+        m_batch = ModelSession();
+    }
+};
+
+
+// Shared inference service for instances running the same model at the same chunk size.
+// Every member posts its chunk, and once all active members have posted (or the deadline
+// has passed) the member completing the batch runs a single {B, chunk} forward and the
+// results are scattered back to each row. The rows of members that didn't post are put
+// back to their state before the run, and a member that misses a batch is idle, so it
+// isn't waited for again until it posts. Members keep their row's state while others
+// join and leave: a joining member takes over a row left by another one, or the batch
+// grows by a session built and settled outside the lock, with the rows carried over.
+class BatchGroup {
+public:
+    // Handle owned by one instance, leaves the group when destroyed
+    class Member {
+    public:
+        ~Member() { m_group->detach(this); }
+
+        // Run a chunk as part of the next batch. Returns false if the batch could not
+        // serve it (the model doesn't batch), in which case the caller should run its own
+        // forward instead. That session hasn't seen the chunks the batch ran, so the
+        // caller resets it first.
+        bool process(const float* chunk, std::chrono::microseconds deadline, PitchResult& result) {
+            return m_group->process(this, chunk, deadline, result);
+        }
+
+        // Return this member's row of the shared batch to its settled state
+        void reset() { m_group->reset(this); }
+
+        const ModelCache::Entry* model() const { return m_group->m_model.get(); }
+        int chunk_size() const { return m_group->m_chunk_size; }
+        bool batchable() const { return m_group->batchable(); }
+        std::string error() const { return m_group->error(); }
+
+    private:
+        friend class BatchGroup;
+        explicit Member(std::shared_ptr<BatchGroup> group) : m_group(std::move(group)) {}
+
+        std::shared_ptr<BatchGroup> m_group;
+        size_t m_row = 0;
+        bool m_placed = false;    // Has a row in the current session
+        bool m_submitted = false;
+        bool m_idle = false;
+        bool m_valid = false;
+        PitchResult m_result;
+    };
+
+    BatchGroup(std::shared_ptr<const ModelCache::Entry> model, int chunk_size)
+        : m_model(std::move(model)), m_chunk_size(chunk_size) {}
+
+    // Join the group for this model and chunk size, creating it if needed
+    static std::unique_ptr<Member> join(const std::shared_ptr<const ModelCache::Entry>& model, int chunk_size) {
+        static std::mutex registry_mutex;
+        static std::unordered_map<std::string, std::weak_ptr<BatchGroup>> registry;
+
+        std::string key = model->key() + "#" + std::to_string(chunk_size);
+        std::shared_ptr<BatchGroup> group;
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            for (auto it = registry.begin(); it != registry.end();) {
+                it = it->second.expired() ? registry.erase(it) : std::next(it);
+            }
+            group = registry[key].lock();
+            if (!group) {
+                group = std::make_shared<BatchGroup>(model, chunk_size);
+                registry[key] = group;
+            }
+        }
+
+        std::unique_ptr<Member> member(new Member(group));
+        group->attach(member.get());
+        return member;
+    }
+
+private:
+    static constexpr int k_warmup_passes = 8; // Silent passes before the shared state is captured
+
+    std::shared_ptr<const ModelCache::Entry> m_model;
+    int m_chunk_size;
+
+    std::mutex m_mutex;
+    std::condition_variable m_done;
+    std::vector<Member*> m_members;
+    std::vector<size_t> m_free_rows;     // Rows of the session no member uses
+    size_t m_submitted = 0;
+    size_t m_active = 0;                 // Placed members that aren't idle
+    uint64_t m_generation = 0;
+    uint64_t m_layout = 0;               // Bumped whenever a member joins or leaves
+    bool m_batchable = true;
+    std::string m_error;
+
+    ModelSession m_session;              // Holds one row of streaming state per member
+    std::vector<PitchResult> m_results;
+
+    bool batchable() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_batchable;
+    }
+
+    std::string error() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_error;
+    }
+
+    void attach(Member* member) {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_members.push_back(member);
+            ++m_layout;
+            // Take over a row another member left, from the settled state
+            if (m_session.valid() && !m_free_rows.empty()) {
+                member->m_row = m_free_rows.back();
+                m_free_rows.pop_back();
+                m_session.reset_row(member->m_row);
+                place(member);
+                return;
+            }
+        }
+        grow();
+    }
+
+    // The row stays in the session until a member takes it over or the batch grows
+    void detach(Member* member) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_members.erase(std::remove(m_members.begin(), m_members.end(), member), m_members.end());
+        ++m_layout;
+        if (m_members.empty()) {
+            m_session = ModelSession();
+            m_free_rows.clear();
+            return;
+        }
+        if (!member->m_placed) return;
+        m_free_rows.push_back(member->m_row);
+        if (member->m_submitted) --m_submitted;
+        if (!member->m_idle) --m_active;
+        if (m_submitted > 0 && m_submitted >= m_active) run_batch(); // The rest were waiting for it
+    }
+
+    void place(Member* member) {
+        member->m_placed = true;
+        member->m_idle = false;
+        ++m_active;
+    }
+
+    void reset(Member* member) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_session.valid() && m_batchable && member->m_placed) m_session.reset_row(member->m_row);
+    }
+
+    // Build a session with a row for every member and settle it on silence like the
+    // per-instance sessions, without the lock so the current batch keeps running. It is
+    // then swapped in with the rows, and pending chunks, of the members already placed
+    // carried over, or built again if members joined or left in the meantime.
+    void grow() {
+        while (true) {
+            size_t rows;
+            uint64_t layout;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_batchable || m_members.empty()) return;
+                rows = m_members.size();
+                layout = m_layout;
+            }
+
+            ModelSession session;
+            std::vector<PitchResult> results(rows);
+            try {
+                session = ModelSession(*m_model, m_chunk_size, (int)rows);
+                for (int pass = 0; pass < k_warmup_passes; ++pass) {
+                    for (size_t row = 0; row < rows; ++row) {
+                        std::fill_n(session.input(row), m_chunk_size, 0.0f);
+                    }
+                    session.run(results.data());
+                }
+                session.capture();
+            }
+            catch (const std::exception& e) {
+                // Streaming state sized for a single row, stop batching for this model
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_batchable = false;
+                m_error = e.what();
+                ++m_generation;
+                m_done.notify_all();
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_layout != layout) continue;
+            for (size_t i = 0; i < m_members.size(); ++i) {
+                Member* member = m_members[i];
+                if (member->m_placed) {
+                    session.copy_row(m_session, member->m_row, i);
+                    if (member->m_submitted) {
+                        std::memcpy(session.input(i), m_session.input(member->m_row), m_chunk_size * sizeof(float));
+                    }
+                    member->m_row = i;
+                } else {
+                    member->m_row = i;
+                    place(member);
+                }
+            }
+            m_session = std::move(session);
+            m_results = std::move(results);
+            m_free_rows.clear();
+            return;
+        }
+    }
+
+    bool process(Member* member, const float* chunk, std::chrono::microseconds deadline, PitchResult& result) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (!m_batchable || !member->m_placed) return false;
+
+        std::memcpy(m_session.input(member->m_row), chunk, m_chunk_size * sizeof(float));
+        member->m_submitted = true;
+        member->m_valid = false;
+        if (member->m_idle) {
+            member->m_idle = false;
+            ++m_active;
+        }
+
+        uint64_t generation = m_generation;
+        if (++m_submitted < m_active) {
+            bool completed = m_done.wait_for(lock, deadline, [&] { return m_generation != generation; });
+            if (!completed) run_batch(); // Deadline passed, serve the members that made it
+        } else {
+            run_batch();
+        }
+
+        if (!member->m_valid) return false;
+        result = member->m_result;
+        return true;
+    }
+
+    // Run the batched forward with the mutex held, so late submissions go to the next
+    // batch. Members that didn't submit keep their row's state and become idle.
+    void run_batch() {
+        bool partial = std::any_of(m_members.begin(), m_members.end(),
+                                   [](const Member* member) { return member->m_placed && !member->m_submitted; });
+        if (partial) m_session.save_state();
+
+        try {
+            m_session.run(m_results.data());
+            for (auto* member : m_members) {
+                if (!member->m_placed) continue;
+                if (!member->m_submitted) {
+                    m_session.restore_row(member->m_row);
+                    continue;
+                }
+                member->m_result = m_results[member->m_row];
+                member->m_valid = true;
+            }
+        }
+        catch (const std::exception& e) {
+            // Streaming state sized for a single row, stop batching for this model
+            m_batchable = false;
+            m_error = e.what();
+        }
+
+        for (auto* member : m_members) {
+            if (member->m_placed && !member->m_submitted && !member->m_idle) {
+                member->m_idle = true;
+                --m_active;
+            }
+            member->m_submitted = false;
+        }
+        m_submitted = 0;
+        ++m_generation;
+        m_done.notify_all();
+    }
+};
+
+
+// Lock-free histogram of durations with four log-spaced buckets per octave, from 1us
+// to over an hour. One thread records, any thread may read or reset, and a read that
+// races a record is off by at most that one sample.
+class LatencyHistogram {
+public:
+    void record(double microseconds) {
+        double value = std::max(microseconds, 0.0);
+        int bucket = std::min(static_cast<int>(4.0 * std::log2(value + 1.0)), k_buckets - 1);
+        m_counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        m_total.fetch_add(1, std::memory_order_relaxed);
+        uint64_t rounded = static_cast<uint64_t>(value);
+        if (rounded > m_max.load(std::memory_order_relaxed)) m_max.store(rounded, std::memory_order_relaxed);
+    }
+    
+    uint64_t count() const {
+        return m_total.load(std::memory_order_relaxed);
+    }
+    
+    // Duration in ms below which a fraction of the samples fall, at bucket resolution (+-9%)
+    double percentile(double fraction) const {
+        uint64_t total = count();
+        if (total == 0) return 0.0;
+        uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(fraction * total)));
+        uint64_t seen = 0;
+        for (int bucket = 0; bucket < k_buckets; ++bucket) {
+            seen += m_counts[bucket].load(std::memory_order_relaxed);
+            if (seen >= target) {
+                double centre = std::exp2((bucket + 0.5) / 4.0) - 1.0;
+                return std::min(centre, static_cast<double>(m_max.load(std::memory_order_relaxed))) / 1000.0;
+            }
+        }
+        return max();
+    }
+    
+    double max() const {
+        return m_max.load(std::memory_order_relaxed) / 1000.0;
+    }
+    
+    void reset() {
+        for (auto& bucket : m_counts) bucket.store(0, std::memory_order_relaxed);
+        m_total.store(0, std::memory_order_relaxed);
+        m_max.store(0, std::memory_order_relaxed);
+    }
+    
+private:
+    static constexpr int k_buckets = 128;
+    std::atomic<uint32_t> m_counts[k_buckets] = {};
+    std::atomic<uint64_t> m_total { 0 };
+    std::atomic<uint64_t> m_max { 0 };
+};
+
+
+// Allocation-free smoothing and note segmentation of one channel's pitch frames. Frames
+// at the -1500 sentinel are unvoiced. A running median over the last frames removes
+// octave jumps and single-frame dropouts, a hysteresis band holds the pitch against
+// small fluctuations, and voiced runs that stay on one note become note events.
+class PitchTracker {
+public:
+    static constexpr int k_max_median = 15;
+    static constexpr float k_unvoiced = -1000.0f; // Pitches below this are the sentinel
+    
+    struct Settings {
+        int median = 1;          // Frames in the running median, 1 for none
+        float hysteresis = 0.0f; // Semitones the pitch has to move before it follows
+        bool notes = false;      // Segment notes
+        int note_frames = 1;     // Frames a note (or silence) has to last before it is reported
+    };
+    
+    struct NoteEvent {
+        bool on;
+        int note;          // MIDI note number
+        float amplitude;   // Model amplitude at the note-on
+    };
+    
+    // Smooth a frame in place and write up to two note events, returns how many
+    int process(PitchResult& frame, const Settings& settings, NoteEvent* events) {
+        m_history[m_next] = frame.pitch;
+        m_next = (m_next + 1) % k_max_median;
+        m_filled = std::min(m_filled + 1, k_max_median);
+        
+        int length = std::min(std::clamp(settings.median, 1, k_max_median), m_filled);
+        if (length > 1) {
+            float window[k_max_median];
+            for (int i = 0; i < length; ++i) {
+                window[i] = m_history[(m_next + k_max_median - 1 - i) % k_max_median];
+            }
+            std::nth_element(window, window + length / 2, window + length);
+            frame.pitch = window[length / 2];
+        }
+        
+        bool voiced = frame.pitch > k_unvoiced;
+        if (!voiced) {
+            m_holding = false;
+        } else if (settings.hysteresis > 0.0f) {
+            if (m_holding && std::abs(frame.pitch - m_held) < settings.hysteresis) {
+                frame.pitch = m_held;
+            } else {
+                m_held = frame.pitch;
+                m_holding = true;
+            }
+        }
+        
+        return settings.notes ? segment(frame, voiced, settings, events) : 0;
+    }
+    
+    // End a sounding note but keep the smoothing history, for when segmentation is turned
+    // off. Returns the number of events written.
+    int end_note(NoteEvent* events) {
+        int count = 0;
+        if (m_sounding) events[count++] = { false, m_note, 0.0f };
+        m_sounding = false;
+        m_candidate = -1;
+        m_candidate_frames = 0;
+        return count;
+    }
+    
+    // Forget the history, ending a sounding note. Returns the number of events written.
+    int reset(NoteEvent* events) {
+        int count = 0;
+        if (m_sounding) events[count++] = { false, m_note, 0.0f };
+        *this = PitchTracker();
+        return count;
+    }
+    
+private:
+    float m_history[k_max_median] = {};
+    int m_next = 0;
+    int m_filled = 0;
+    float m_held = 0.0f;
+    bool m_holding = false;
+    
+    bool m_sounding = false; // A note-on has been reported
+    int m_note = 0;
+    int m_candidate = -1;    // Note (or -1 for silence) the recent frames agree on
+    int m_candidate_frames = 0;
+    
+    int segment(const PitchResult& frame, bool voiced, const Settings& settings, NoteEvent* events) {
+        // Frames near the sounding note, within half a semitone plus the hysteresis, sustain it
+        if (voiced && m_sounding && std::abs(frame.pitch - m_note) <= 0.5f + settings.hysteresis) {
+            m_candidate_frames = 0;
+            return 0;
+        }
+        
+        int candidate = voiced ? static_cast<int>(std::lround(frame.pitch)) : -1;
+        if (candidate == m_candidate) {
+            ++m_candidate_frames;
+        } else {
+            m_candidate = candidate;
+            m_candidate_frames = 1;
+        }
+        if (m_candidate_frames < std::max(settings.note_frames, 1)) return 0;
+        if (candidate < 0 && !m_sounding) {
+            m_candidate_frames = 0; // Silence goes on, nothing to end
+            return 0;
+        }
+        
+        int count = 0;
+        if (m_sounding) events[count++] = { false, m_note, 0.0f };
+        m_sounding = candidate >= 0;
+        if (m_sounding) {
+            m_note = candidate;
+            events[count++] = { true, m_note, frame.amplitude };
+        }
+        m_candidate_frames = 0;
+        return count;
+    }
+};
+
+
+// Allocation-free multi-pitch candidates from one frame of the model's pitch activations.
+// Bins are evenly spaced in pitch, 128 semitones' worth of them, and their offset is
+// calibrated against the model's own pitch, which always sits on the strongest peak.
+class PitchCandidates {
+public:
+    static constexpr int k_max_candidates = 8;
+    
+    struct Candidate {
+        float pitch;     // MIDI pitch, fractional
+        float salience;  // Activation at the peak
+    };
+    
+    // Write up to count peaks of at least min_salience, strongest first, returns how many
+    int find(const float* activations, int bins, float reference_pitch, int count,
+             float min_salience, Candidate* candidates) {
+        count = std::clamp(count, 0, k_max_candidates);
+        if (!activations || bins < 3 || count == 0) return 0;
+        int bins_per_semitone = bins % 128 == 0 ? bins / 128 : 3;
+        
+        int found = 0;
+        int peaks[k_max_candidates];
+        for (int bin = 1; bin < bins - 1; ++bin) {
+            float value = activations[bin];
+            if (value < min_salience || value <= activations[bin - 1] || value < activations[bin + 1]) continue;
+            
+            // Peaks closer than a semitone are one partial, keep the stronger of them
+            int slot = found;
+            for (int i = 0; i < found; ++i) {
+                if (bin - peaks[i] < bins_per_semitone) {
+                    slot = activations[peaks[i]] < value ? i : -1;
+                    break;
+                }
+            }
+            if (slot < 0) continue;
+            if (slot == found) {
+                if (found == count && activations[peaks[found - 1]] >= value) continue;
+                if (found < count) ++found;
+                slot = found - 1;
+            }
+            // Move the peak up to its place in the strongest-first order
+            for (; slot > 0 && activations[peaks[slot - 1]] < value; --slot) peaks[slot] = peaks[slot - 1];
+            peaks[slot] = bin;
+        }
+        
+        for (int i = 0; i < found; ++i) {
+            // Parabolic interpolation between the neighbouring bins
+            float left = activations[peaks[i] - 1], centre = activations[peaks[i]], right = activations[peaks[i] + 1];
+            float curvature = left - 2.0f * centre + right;
+            float shift = curvature < 0.0f ? 0.5f * (left - right) / curvature : 0.0f;
+            candidates[i] = { (peaks[i] + shift) / bins_per_semitone, centre };
+        }
+        
+        if (found > 0 && reference_pitch > PitchTracker::k_unvoiced) {
+            m_offset = reference_pitch - candidates[0].pitch;
+        }
+        for (int i = 0; i < found; ++i) candidates[i].pitch += m_offset;
+        return found;
+    }
+    
+    void reset() { m_offset = 0.0f; }
+
+private:
+    float m_offset = 0.0f; // Pitch of bin 0, from the last voiced frame
+};
+
+
+// Latency statistics of one benchmark configuration
+struct BenchResult {
+    std::string mode;            // "single", "batch" or "instances"
+    int size = 1;                // Batch size or number of concurrent instances
+    int iterations = 0;
+    double min_ms = 0.0;
+    double median_ms = 0.0;
+    double p99_ms = 0.0;
+    double max_ms = 0.0;
+    double chunks_per_second = 0.0;
+    double realtime_factor = 0.0; // Wall time over the audio duration of one stream, below 1 keeps up
+    std::string error;           // Set when the configuration couldn't run
+};
+
+
+// Difference between the outputs of a reduced precision model and its fp32 variant
+struct AccuracyDelta {
+    bool valid = false;
+    double mean_pitch = 0.0;      // Mean absolute pitch difference in semitones
+    double max_pitch = 0.0;       // Largest absolute pitch difference in semitones
+    double mean_confidence = 0.0; // Mean absolute confidence difference
+};
+
+
+// Benchmark results of one model file
+struct BenchReport {
+    std::string model;
+    std::vector<BenchResult> runs;
+    AccuracyDelta accuracy;
+};
+
+
+// Times forward passes of one cached model on random input, as a single stream, as
+// one batched forward over several streams, or as several instances running at once.
+// Every configuration gets a few untimed warm-up passes first.
+class Benchmark {
+public:
+    Benchmark(std::shared_ptr<const ModelCache::Entry> model, int chunk_size, double samplerate,
+              int intra_threads, const std::atomic<bool>& cancel)
+        : m_model(std::move(model)), m_chunk_size(chunk_size), m_samplerate(samplerate),
+          m_intra_threads(intra_threads), m_cancel(cancel) {}
+    
+    // One {batch, chunk} forward per iteration, batch 1 is the plain streaming case
+    BenchResult batched(int batch, int iterations) {
+        BenchResult result;
+        result.mode = batch == 1 ? "single" : "batch";
+        result.size = batch;
+        try {
+            ModelSession session(*m_model, m_chunk_size, batch);
+            std::vector<PitchResult> rows(batch);
+            std::vector<double> latencies;
+            warm_up(session, rows.data());
+            auto start_time = std::chrono::steady_clock::now();
+            time_session(session, rows.data(), iterations, latencies);
+            double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+            summarize(result, latencies, wall, batch);
+        }
+        catch (const std::exception& e) {
+            result.error = e.what();
+        }
+        return result;
+    }
+    
+    // Several single-stream instances on their own threads, started together
+    BenchResult instances(int count, int iterations) {
+        BenchResult result;
+        result.mode = "instances";
+        result.size = count;
+        
+        std::vector<std::vector<double>> latencies(count);
+        std::vector<std::string> errors(count);
+        std::latch ready(count + 1);
+        std::vector<std::thread> workers;
+        for (int i = 0; i < count; ++i) {
+            workers.emplace_back([&, i]() {
+                torch::NoGradGuard no_grad;
+                if (m_intra_threads > 0) at::set_num_threads(m_intra_threads);
+                bool started = false;
+                try {
+                    ModelSession session(*m_model, m_chunk_size);
+                    PitchResult row;
+                    warm_up(session, &row);
+                    started = true;
+                    ready.arrive_and_wait();
+                    time_session(session, &row, iterations, latencies[i]);
+                }
+                catch (const std::exception& e) {
+                    errors[i] = e.what();
+                    if (!started) ready.count_down();
+                }
+            });
+        }
+        ready.arrive_and_wait();
+        auto start_time = std::chrono::steady_clock::now();
+        for (auto& worker : workers) worker.join();
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        
+        for (const auto& error : errors) {
+            if (!error.empty()) {
+                result.error = error;
+                return result;
+            }
+        }
+        std::vector<double> all;
+        for (const auto& thread_latencies : latencies) {
+            all.insert(all.end(), thread_latencies.begin(), thread_latencies.end());
+        }
+        summarize(result, all, wall, count, iterations);
+        return result;
+    }
+    
+    // Run a sine sweep from 110Hz to 880Hz through fresh instances of both models and
+    // compare their outputs, ignoring the first chunks while the streaming state settles
+    static AccuracyDelta compare(const ModelCache::Entry& model, const ModelCache::Entry& reference,
+                                 int chunk_size, double samplerate) {
+        constexpr int k_chunks = 64;
+        constexpr int k_settle = 8;
+        ModelSession session(model, chunk_size);
+        ModelSession reference_session(reference, chunk_size);
+        
+        AccuracyDelta delta;
+        double phase = 0.0;
+        for (int chunk = 0; chunk < k_chunks; ++chunk) {
+            for (int i = 0; i < chunk_size; ++i) {
+                double progress = static_cast<double>(chunk * chunk_size + i) / (k_chunks * chunk_size);
+                phase += 2.0 * M_PI * 110.0 * std::exp2(3.0 * progress) / samplerate;
+                session.input()[i] = reference_session.input()[i] = static_cast<float>(0.5 * std::sin(phase));
+            }
+            PitchResult result, expected;
+            session.run(&result);
+            reference_session.run(&expected);
+            if (chunk < k_settle) continue;
+            double pitch_error = std::abs(result.pitch - expected.pitch);
+            delta.mean_pitch += pitch_error / (k_chunks - k_settle);
+            delta.max_pitch = std::max(delta.max_pitch, pitch_error);
+            delta.mean_confidence += std::abs(result.confidence - expected.confidence) / (k_chunks - k_settle);
+        }
+        delta.valid = true;
+        return delta;
+    }
+    
+private:
+    std::shared_ptr<const ModelCache::Entry> m_model;
+    int m_chunk_size;
+    double m_samplerate;
+    int m_intra_threads;
+    const std::atomic<bool>& m_cancel;
+    
+    void fill_noise(ModelSession& session) {
+        std::mt19937 generator(1234);
+        std::uniform_real_distribution<float> noise(-1.0f, 1.0f);
+        for (int row = 0; row < session.batch_size(); ++row) {
+            float* input = session.input(row);
+            for (int i = 0; i < m_chunk_size; ++i) input[i] = noise(generator);
+        }
+    }
+    
+    void warm_up(ModelSession& session, PitchResult* rows) {
+        fill_noise(session);
+        for (int i = 0; i < 8 && !m_cancel; ++i) session.run(rows);
+    }
+    
+    // Time the passes of a warmed up session, so neither latencies nor wall time include warm-up
+    void time_session(ModelSession& session, PitchResult* rows, int iterations, std::vector<double>& latencies) {
+        latencies.reserve(iterations);
+        for (int i = 0; i < iterations && !m_cancel; ++i) {
+            auto start_time = std::chrono::steady_clock::now();
+            session.run(rows);
+            latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_time).count());
+        }
+    }
+    
+    // Chunks per second count every stream, the real-time factor compares the wall time
+    // against the audio each of the concurrent streams covered
+    void summarize(BenchResult& result, std::vector<double>& latencies, double wall, int streams, int per_stream = 0) {
+        if (latencies.empty()) {
+            result.error = "cancelled";
+            return;
+        }
+        std::sort(latencies.begin(), latencies.end());
+        size_t n = latencies.size();
+        int iterations = per_stream > 0 ? per_stream : static_cast<int>(n);
+        result.iterations = iterations;
+        result.min_ms = latencies.front();
+        result.median_ms = latencies[n / 2];
+        result.p99_ms = latencies[std::min(n - 1, static_cast<size_t>(std::ceil(0.99 * n)) - 1)];
+        result.max_ms = latencies.back();
+        result.chunks_per_second = wall > 0.0 ? iterations * streams / wall : 0.0;
+        double audio_seconds = iterations * m_chunk_size / m_samplerate;
+        result.realtime_factor = audio_seconds > 0.0 ? wall / audio_seconds : 0.0;
+    }
+};
+
+
+// A string as a quoted JSON string, with quotes, backslashes and control characters
+// escaped. Shared by every JSON file the package writes.
+std::string json_quoted(const std::string& text);
+
+
+// Per-machine tuning measured by a benchmark run, stored as a small JSON file next to
+// the models folder so new instances start from the fastest configuration that keeps up
+class TuningProfile {
+public:
+    static constexpr const char* k_filename = "pesto_profile.json";
+    static constexpr double k_headroom = 0.5;        // Share of a chunk's duration the p99 may take
+    static constexpr double k_max_pitch_error = 0.1; // Mean semitones a reduced precision may be off
+    
+    std::string model;              // Model file the configuration was measured with
+    int chunk_size = 0;             // 0 when there is no profile
+    std::string precision = "fp32";
+    std::string backend = "torchscript";
+    std::string device = "cpu";
+    bool optimize = false;
+    int threads = 0;                // Intra-op threads, 0 for libtorch's default
+    double p99_ms = 0.0;            // Single-stream p99 at these settings
+    double budget_ms = 0.0;         // Duration of one chunk
+    
+    bool valid() const { return chunk_size > 0; }
+    
+    // The smallest chunk whose single-stream p99 fits the headroom, reduced precision only
+    // when it stays close to its fp32 variant, and the lower p99 between equal chunks.
+    // Invalid when nothing keeps up.
+    static TuningProfile choose(const std::vector<BenchReport>& report);
+    
+    // An invalid profile when the file is missing or unreadable
+    static TuningProfile read(const fs::path& file);
+    bool write(const fs::path& file, std::string& error) const;
+};
+
+
+// Analyses a whole recording faster than real time. The recording is cut into up to
+// k_max_streams equal segments that run side by side as the rows of one batched forward.
+// Each segment starts k_preroll chunks early so its streaming state has settled on the
+// preceding audio by the time its first result is kept. Chunks are conditioned, gated,
+// thresholded and smoothed the way the live input is, so the results match a real-time
+// run of the same settings.
+class OfflineAnalyzer {
+public:
+    static constexpr int k_max_streams = 8;
+    static constexpr int k_preroll = 8;
+    
+    // The live processing around the model
+    struct Settings {
+        bool remove_dc = false;
+        float gain = 1.0f;
+        float gate = 0.0f;       // RMS below which a chunk is unvoiced, 0 for off
+        float confidence = 0.0f; // Unvoiced below this confidence, 0 for off
+        float amplitude = 0.0f;  // Unvoiced below this amplitude, 0 for off
+        PitchTracker::Settings tracker;
+    };
+    
+    OfflineAnalyzer(std::shared_ptr<const ModelCache::Entry> model, int chunk_size, const std::atomic<bool>& cancel,
+                    const Settings& settings)
+        : m_model(std::move(model)), m_chunk_size(chunk_size), m_cancel(cancel), m_settings(settings) {}
+    
+    // One result per chunk of audio, the last chunk padded with silence. Returns false
+    // if cancelled. Throws c10::Error if the model itself fails.
+    bool run(const std::vector<float>& audio, std::vector<PitchResult>& results) {
+        size_t chunks = (audio.size() + m_chunk_size - 1) / m_chunk_size;
+        results.assign(chunks, PitchResult());
+        if (chunks == 0) return true;
+        
+        // Short recordings aren't worth the pre-roll of extra streams
+        int streams = static_cast<int>(std::clamp<size_t>(chunks / (4 * k_preroll), 1, k_max_streams));
+        bool done = false;
+        if (streams > 1) {
+            try {
+                done = run_streams(audio, results, streams);
+                if (!done) return false;
+            }
+            catch (const std::exception&) {
+                // The model's state can't take a batch dimension, analyse as one stream
+            }
+        }
+        if (!done && !run_streams(audio, results, 1)) return false;
+        
+        // The smoothing runs over the whole recording in order, as it does live
+        PitchTracker tracker;
+        PitchTracker::Settings smoothing = m_settings.tracker;
+        smoothing.notes = false;
+        PitchTracker::NoteEvent events[2];
+        for (auto& result : results) tracker.process(result, smoothing, events);
+        return true;
+    }
+    
+private:
+    std::shared_ptr<const ModelCache::Entry> m_model;
+    int m_chunk_size;
+    const std::atomic<bool>& m_cancel;
+    Settings m_settings;
+    
+    bool run_streams(const std::vector<float>& audio, std::vector<PitchResult>& results, int streams) {
+        ptrdiff_t chunks = results.size();
+        ptrdiff_t segment = (chunks + streams - 1) / streams;
+        ptrdiff_t preroll = streams > 1 ? k_preroll : 0;
+        
+        ModelSession session(*m_model, m_chunk_size, streams);
+        std::vector<PitchResult> rows(streams);
+        std::vector<char> gated(streams);
+        
+        for (ptrdiff_t step = -preroll; step < segment; ++step) {
+            if (m_cancel) return false;
+            for (int row = 0; row < streams; ++row) {
+                float* input = session.input(row);
+                fill_chunk(audio, row * segment + step, input);
+                ChunkLevel level = ChunkLevel::measure(input, m_chunk_size);
+                level.condition(input, m_chunk_size, m_settings.remove_dc, m_settings.gain);
+                gated[row] = m_settings.gate > 0.0f && level.rms < m_settings.gate;
+            }
+            session.run(rows.data());
+            // Live, gated chunks skip the model and the state restarts when the gate opens
+            for (int row = 0; row < streams; ++row) {
+                if (gated[row]) session.reset_row(row);
+            }
+            if (step < 0) continue;
+            for (int row = 0; row < streams; ++row) {
+                ptrdiff_t index = row * segment + step;
+                if (index >= chunks) continue;
+                PitchResult& result = results[index];
+                result = rows[row];
+                if (gated[row]) {
+                    result = PitchResult { -1500.0f, 0.0f, 0.0f };
+                } else if ((m_settings.confidence > 0.0f && result.confidence < m_settings.confidence) ||
+                           (m_settings.amplitude > 0.0f && result.amplitude < m_settings.amplitude)) {
+                    result.pitch = -1500.0f; // The sentinel of an unvoiced frame
+                }
+            }
+        }
+        return true;
+    }
+    
+    // Copy one chunk of the recording, silence outside of it
+    void fill_chunk(const std::vector<float>& audio, ptrdiff_t index, float* dest) {
+        std::fill_n(dest, m_chunk_size, 0.0f);
+        if (index < 0) return;
+        size_t start = index * m_chunk_size;
+        if (start >= audio.size()) return;
+        size_t count = std::min<size_t>(m_chunk_size, audio.size() - start);
+        std::copy_n(audio.data() + start, count, dest);
+    }
+};
@@ -4,77 +4,29 @@
 ///	@license	Use of this source code is governed by the MIT License found in the License.md file.
 
 #include "c74_min.h"
-#include <torch/torch.h>
-#include <torch/script.h>
-#include <regex>
+#include "pesto_core.h"
 #include <vector>
 #include <string>
 #include <filesystem>
 #include <thread>
 #include <mutex>
 #include <semaphore>
+#include <condition_variable>
 #include <atomic>
 #include <chrono>
-namespace fs = std::filesystem;
+#include <memory>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <numeric>
+#include <cmath>
+#include <limits>
+#include <tuple>
+#include <optional>
+#include <fstream>
 
 using namespace c74::min;
 
-// Power-of-2 ceiling function for efficient circular buffer sizing
-unsigned power_ceil(unsigned x) {
-    if (x <= 1) return 1;
-    int power = 2;
-    x--;
-    while (x >>= 1) power <<= 1;
-    return power;
-}
-
-// Circular buffer class for efficient audio buffering
-class CircularBuffer {
-private:
-    std::vector<float> buffer;
-    std::atomic<size_t> write_pos{0};
-    std::atomic<size_t> read_pos{0};
-    size_t capacity;
-    size_t mask; // For power-of-2 optimization
-    
-public:
-    CircularBuffer() : capacity(0), mask(0) {}
-    
-    void resize(size_t size) {
-        capacity = power_ceil(size);
-        mask = capacity - 1;
-        buffer.resize(capacity);
-        write_pos = 0;
-        read_pos = 0;
-    }
-    
-    void put(float sample) {
-        size_t pos = write_pos.load(std::memory_order_relaxed) & mask;
-        buffer[pos] = sample;
-        write_pos.store(write_pos.load(std::memory_order_relaxed) + 1, std::memory_order_release);
-    }
-    
-    bool get(float* dest, size_t count) {
-        if (available() < count) return false;
-        
-        size_t pos = read_pos.load(std::memory_order_relaxed) & mask;
-        for (size_t i = 0; i < count; ++i) {
-            dest[i] = buffer[(pos + i) & mask];
-        }
-        read_pos.store(read_pos.load(std::memory_order_relaxed) + count, std::memory_order_release);
-        return true;
-    }
-    
-    size_t available() const {
-        return write_pos.load(std::memory_order_acquire) - read_pos.load(std::memory_order_acquire);
-    }
-    
-    void clear() {
-        write_pos = 0;
-        read_pos = 0;
-    }
-};
-
 
 class pesto : public object<pesto>, public vector_operator<> {
 public:
@@ -84,14 +36,21 @@ public:
     MIN_RELATED		{"fzero~, fiddle~, sigmund~"};
 
     // Initial chunk size argument that determines target model size at initialization
-    argument<number> init_chunk {this, "init_chunk", "Specify model chunk size. Specifying a size will load a matching model from pesto/models. Use 0 to load the fastest available model.", true,
+    argument<number> init_chunk {this, "init_chunk", "Specify model chunk size. Specifying a size will load a matching model from pesto/models. Use 0 for the chunk size of the tuning profile written by 'bench', or the smallest available model without one.", true,
         MIN_ARGUMENT_FUNCTION {
             m_target_chunk = arg;
-            // Initialize model with the specified chunk size
+            if (m_target_chunk == 0) m_target_chunk = m_profile.chunk_size;
+            use_profile_tuning(m_target_chunk == m_profile.chunk_size);
+            // Request a model with the specified chunk size, loaded once DSP reports the sample rate
             initialize_model();
         }
     };
 
+    // Number of input channels, read in the constructor since inlets are created there
+    argument<int> init_chans { this, "chans", "Number of input channels to analyse (default 1). Each channel gets its own signal inlet and streaming state, all channels run through one batched forward, and results are output as lists from the float outlets. The signal outlets follow the first channel.", false,
+        MIN_ARGUMENT_FUNCTION {}
+    };
+
     // This message is called once the object is fully constructed
     message<> maxclass_setup { this, "maxclass_setup",
         MIN_FUNCTION {         
@@ -122,11 +81,65 @@ public:
             return {};
         }
     };
+    
+    message<> rescan { this, "rescan", "Rescan the models folders for added, removed or renamed model files. They are normally picked up on the next load, this forces it for every pesto~ instance. Reports 'models <count>' from the info outlet.",
+        MIN_FUNCTION {
+            auto index = model_index(true);
+            cout << "Found " << index->files().size() << " model files" << endl;
+            post_info({ symbol("models"), static_cast<int>(index->files().size()) });
+            return {};
+        }
+    };
 
     inlet<>  input	{ this, "(signal) audio input, (bang) clear buffers and reset model state" };
     outlet<> pitch_output	{ this, "(float) model's pitch prediction in MIDI note number" };
     outlet<> confidence_output	{ this, "(float) model's confidence prediction (0-1)" };
     outlet<> amplitude_output	{ this, "(float) model's amplitude prediction" };
+    outlet<> pitch_signal	{ this, "(signal) sample-aligned pitch prediction in MIDI note number of the first channel, see @signal", "signal" };
+    outlet<> confidence_signal	{ this, "(signal) sample-aligned confidence prediction (0-1) of the first channel, see @signal", "signal" };
+    outlet<> amplitude_signal	{ this, "(signal) sample-aligned amplitude prediction of the first channel, see @signal", "signal" };
+    outlet<> info_output	{ this, "(anything) notifications: 'ready <model> <chunk>' once a model is swapped in, 'error <message>' when loading fails, and 'note on|off' events with @notes, 'time <sample> <ms>' before each result with @timestamps, 'poly <pitch> <salience> ...' before each result with @poly" };
+    
+    // Send queued results from the scheduler thread. When more have piled up than a
+    // patch can use, only the newest ones are sent.
+    timer<> deliver_results { this,
+        MIN_FUNCTION {
+            m_results_scheduled.store(false, std::memory_order_release);
+            NoteRecord note;
+            while (m_note_queue.pop(note)) {
+                if (timestamps) send_timestamp(note.timestamp);
+                send_note(note);
+            }
+            
+            size_t pending = m_result_queue.size();
+            for (; pending > k_max_result_burst; --pending) {
+                m_result_queue.pop();
+                m_stat_coalesced.fetch_add(1, std::memory_order_relaxed);
+            }
+            ResultRecord record;
+            while (pending-- > 0 && m_result_queue.pop(record)) {
+                if (timestamps) send_timestamp(record.timestamp);
+                if (record.poly > 0) send_candidates(record);
+                send_results(record);
+            }
+            return {};
+        }
+    };
+    
+    // Deliver loader notifications on the main thread
+    queue<> deliver_info { this,
+        MIN_FUNCTION {
+            std::vector<atoms> messages;
+            {
+                std::lock_guard<std::mutex> lock(m_info_mutex);
+                messages.swap(m_info_messages);
+            }
+            for (const auto& message : messages) {
+                info_output.send(message);
+            }
+            return {};
+        }
+    };
 
     // Confidence threshold
     attribute<number> conf { this, "conf", 0.0,
@@ -161,10 +174,227 @@ public:
         }}
     };
 
-    message<> bang { this, "bang", "Reset the object by clearing buffers. Reset the object by clearing both the Max external's and the PESTO model's internal circular buffer.",
+    attribute<bool> dc { this, "dc", false,
+        description { "Remove each chunk's DC offset before it goes to the model" },
+        setter { MIN_FUNCTION {
+            m_remove_dc = args[0];
+            return {};
+        }}
+    };
+
+    attribute<number> gain { this, "gain", 1.0,
+        description { "Linear gain applied to every chunk before it goes to the model, and before the @gate level is measured" },
+        setter { MIN_FUNCTION {
+            m_input_gain = static_cast<float>(number(args[0]));
+            return {};
+        }}
+    };
+
+    attribute<number> gate { this, "gate", 0.0,
+        description { "Input gate (RMS level, 0+). If not set every chunk is analysed, when set, chunks whose RMS is below the level skip inference and output pitch -1500 with zero confidence and amplitude, and the model state is reset when the gate closes. 'stats' reports the input level" },
+        setter { MIN_FUNCTION {
+            number threshold = args[0];
+            m_gate_threshold = std::max(threshold, 0.0);
+            return {};
+        }}
+    };
+
+    attribute<int> smooth { this, "smooth", 1,
+        description { "Running median over this many pitch frames (odd, up to 15, 1 for none). Removes octave jumps and single-frame dropouts, and delays pitch by half the frames" },
+        setter { MIN_FUNCTION {
+            int frames = std::clamp(int(args[0]), 1, PitchTracker::k_max_median);
+            m_median_frames = frames | 1;
+            return { m_median_frames };
+        }}
+    };
+
+    attribute<number> hyst { this, "hyst", 0.0,
+        description { "Pitch hysteresis in semitones (0+). When set, pitch holds its value until it has moved by more than this, and notes tolerate it on top of half a semitone" },
+        setter { MIN_FUNCTION {
+            number semitones = args[0];
+            m_hysteresis = static_cast<float>(std::max(semitones, 0.0));
+            return {};
+        }}
+    };
+
+    attribute<bool> notes { this, "notes", false,
+        description { "Note segmentation. When enabled, voiced runs that stay on one MIDI note are reported from the info outlet as 'note on <note> <amplitude>' and 'note off <note>' (followed by the channel number when analysing several channels)" },
+        setter { MIN_FUNCTION {
+            m_notes_enabled = args[0];
+            return {};
+        }}
+    };
+
+    attribute<number> notemin { this, "notemin", 40.0,
+        description { "Time in ms a pitch (or silence) has to last before a note starts (or ends), see @notes" },
+        setter { MIN_FUNCTION {
+            number ms = args[0];
+            m_note_min_ms = std::max(ms, 0.0);
+            return {};
+        }}
+    };
+
+    attribute<int> poly { this, "poly", 0,
+        description { "Polyphonic candidates (0-8, 0 for off). Sends up to this many peaks of the model's pitch activations as 'poly <pitch> <salience> ...' from the info outlet before every result, strongest first (preceded by the channel number when analysing several channels). Needs a model that returns its activations after pitch, confidence and amplitude, and is not available with @batch" },
+        setter { MIN_FUNCTION {
+            int count = std::clamp(int(args[0]), 0, PitchCandidates::k_max_candidates);
+            m_poly_count.store(count, std::memory_order_relaxed);
+            m_poly_warned = false;
+            return { count };
+        }}
+    };
+
+    attribute<number> polymin { this, "polymin", 0.02,
+        description { "Minimum activation of a polyphonic candidate, see @poly" },
+        setter { MIN_FUNCTION {
+            number salience = args[0];
+            m_poly_min_salience = static_cast<float>(std::max(salience, 0.0));
+            return {};
+        }}
+    };
+
+    attribute<bool> frames { this, "frames", true,
+        description { "Send every analysed frame from the pitch, confidence and amplitude outlets. Disable to only receive note events, see @notes" },
+        setter { MIN_FUNCTION {
+            m_send_frames = args[0];
+            return {};
+        }}
+    };
+
+    enum class signal_modes : int { off, hold, linear, enum_count };
+    
+    enum_map signal_mode_range = {"off", "hold", "linear"};
+    
+    attribute<signal_modes> signal_mode { this, "signal", signal_modes::off, signal_mode_range,
+        description { "Signal-rate outputs. When not 'off', results are also written to the signal outlets one chunk after the end of the audio they were computed from, either held until the next result ('hold') or ramped over one hop ('linear'). With several input channels the signal outlets follow the first channel, the float outlets send every channel as lists" }
+    };
+
+    attribute<bool> timestamps { this, "timestamps", false,
+        description { "Send 'time <sample> <ms>' from the info outlet right before every result and note event. It is the first sample of the analysed window, counted in host samples since the object started processing audio, and compensated for the resampler's delay" }
+    };
+
+    enum class resample_modes : int { off, automatic, on, enum_count };
+    
+    enum_map resample_mode_range = {"off", "auto", "on"};
+    
+    attribute<resample_modes> resample { this, "resample", resample_modes::automatic, resample_mode_range,
+        description { "Sample rate conversion. 'off' only loads models exported at the host sample rate, 'auto' resamples to the model's rate when no such model exists, 'on' always prefers models closest to 44.1kHz and resamples (e.g. to halve the inference work at 96kHz). Applies to the next model load" }
+    };
+
+    enum class overrun_policies : int { oldest, latest, block, enum_count };
+    
+    enum_map overrun_policy_range = {"oldest", "latest", "block"};
+    
+    attribute<overrun_policies> overrun { this, "overrun", overrun_policies::oldest, overrun_policy_range,
+        description { "Overrun policy, when inference falls behind the incoming audio. 'oldest' drops the oldest unanalysed audio, 'latest' skips straight to the newest chunk for the lowest latency, 'block' stops buffering until inference catches up and discards the audio arriving meanwhile" }
+    };
+
+    attribute<int> hop { this, "hop", 0,
+        description { "Hop size in samples. Runs inference every hop samples on overlapping windows of the model's chunk size, for faster pitch updates with large chunk models. Rounded down to a divisor of the chunk size, 0 uses the chunk size. Changing it prepares the loaded model again in the background, like a chunk change" },
+        setter { MIN_FUNCTION {
+            int hop_size = args[0];
+            m_hop_request = std::max(hop_size, 0);
+            request_hop_change();
+            return {};
+        }}
+    };
+
+    attribute<bool> batch { this, "batch", false,
+        description { "Batched inference. When enabled, instances running the same model at the same chunk size share a single batched forward pass per chunk instead of each running their own" },
+        setter { MIN_FUNCTION {
+            m_batch_enabled = args[0];
+            return {};
+        }}
+    };
+
+    attribute<bool> auto_chunk { this, "auto", false,
+        description { "Adapt the chunk size to the machine's load. While enabled, the time each forward takes is measured against the time its hop of audio lasts: above 60% (or when chunks are dropped or results come later than a hop) the next larger compatible model is loaded, below 15% for several seconds the next smaller one, trading latency for headroom as the load changes. With an explicit @hop a larger chunk only costs more per hop, so the chunk size then only steps down. Models are swapped without interrupting the analysis" },
+        setter { MIN_FUNCTION {
+            m_auto_enabled = args[0];
+            return args;
+        }}
+    };
+
+    attribute<bool> optimize { this, "optimize", false,
+        description { "Freeze the model and apply TorchScript's inference optimizations when loading it. Can speed up inference, but not every model supports it (it then runs as exported). Applies to the next model load" }
+    };
+
+    attribute<bool> mmap_weights { this, "mmap", false,
+        description { "Load .pt models from a memory-mapped file and keep their weights in a read-only weight file private to the current user, so every instance and Max process of the user running the same model uses one copy of its parameters in memory (buffers stay private per instance). This saves memory, not load time: every load still reads the whole model file, and the first load of a model also writes and checks its weight file. CPU only. Applies to the next model load" }
+    };
+
+    enum class devices : int { cpu, mps, cuda, enum_count };
+    
+    enum_map device_range = {"cpu", "mps", "cuda"};
+    
+    attribute<devices> device { this, "device", devices::cpu, device_range,
+        description { "Device to run inference on: 'cpu', 'mps' (Apple Silicon GPU) or 'cuda' (NVIDIA GPU). Falls back to the CPU when the device isn't available. GPUs pay off most with batched inference serving many voices. Applies to the next model load" }
+    };
+
+    enum class precisions : int { fp32, fp16, bf16, int8, automatic, enum_count };
+    
+    enum_map precision_range = {"fp32", "fp16", "bf16", "int8", "auto"};
+    
+    attribute<precisions> precision { this, "precision", precisions::fp32, precision_range,
+        description { "Model precision, chosen from the variants in the models folder tagged _fp16, _bf16 or _int8 after the chunk size (untagged models are fp32). Falls back to fp32 when the chosen variant doesn't exist for a chunk size. 'auto' picks the variant that is usually fastest on the current device. Applies to the next model load" }
+    };
+
+    attribute<int> warmup { this, "warmup", 8,
+        description { "Number of silent warm-up passes run on a newly loaded model in the background, before it is swapped in, so TorchScript's profiling runs don't cause latency spikes in the first seconds of audio. Applies to the next model load" },
+        setter { MIN_FUNCTION {
+            int passes = args[0];
+            return { std::max(passes, 0) };
+        }}
+    };
+
+    attribute<int> threads { this, "threads", 0,
+        description { "Number of intra-op threads libtorch uses for this instance's inference, 0 keeps libtorch's default (one per core). With many instances, 1 avoids oversubscribing the cores Max's audio thread runs on" },
+        setter { MIN_FUNCTION {
+            int count = args[0];
+            m_intra_threads = std::max(count, 0);
+            m_thread_settings_changed = true;
+            return {};
+        }}
+    };
+
+    attribute<int> interop { this, "interop", 0,
+        description { "Number of libtorch inter-op threads. Process-wide, and only takes effect before the first model runs, 0 keeps libtorch's default" },
+        setter { MIN_FUNCTION {
+            int count = args[0];
+            m_interop_threads = std::max(count, 0);
+            m_thread_settings_changed = true;
+            return {};
+        }}
+    };
+
+    attribute<numbers> affinity { this, "affinity", {},
+        description { "List of CPU cores (from 0) the inference thread may run on, empty for any core. On macOS this is only an affinity hint" },
+        setter { MIN_FUNCTION {
+            uint64_t cores = 0;
+            for (const auto& core : args) {
+                int index = core;
+                if (index >= 0 && index < 64) cores |= uint64_t(1) << index;
+            }
+            m_affinity_mask = cores;
+            m_thread_settings_changed = true;
+            return {};
+        }}
+    };
+
+    enum_map priority_range = {"normal", "high", "realtime"};
+
+    attribute<ThreadControl::Priority> priority { this, "priority", ThreadControl::Priority::normal, priority_range,
+        description { "Scheduling priority of the inference thread. 'realtime' may need extra permissions on Linux" },
+        setter { MIN_FUNCTION {
+            m_thread_settings_changed = true;
+            return args;
+        }}
+    };
+
+    message<> bang { this, "bang", "Reset the object by clearing buffers. Reset the object by clearing both the Max external's and the PESTO model's internal circular buffer. The model state is restored before the next chunk, through the model's reset() method if it exports one and otherwise from a copy of its settled state, without blocking the message thread.",
         MIN_FUNCTION {
             clear_buffer();
-            feed_zeros_to_model();
+            m_reset_requested.store(true, std::memory_order_release);
             return {};
         }
     };
@@ -174,6 +404,16 @@ public:
             m_samplerate = args[0];
             m_vectorsize = args[1];
             m_dsp_active = true;
+            {
+                std::lock_guard<std::mutex> lock(m_model_mutex);
+                configure_resampler();
+            }
+            
+            // Models are picked for the host rate, so load once it is known and again when it changes
+            m_rate_known = true;
+            if (m_samplerate != m_requested_samplerate) {
+                initialize_model();
+            }
             
             return {};
         }
@@ -195,10 +435,10 @@ public:
         }
     };
 
-    message<> test { this, "test", "Test inference latency. Run model inference on random test chunk and report the TorchScript model's inference latency",
+    message<> test { this, "test", "Test inference latency. Run model inference on random test chunk and report the TorchScript model's inference latency. A reduced precision model is then compared against its fp32 variant in the background, reported as 'test accuracy <mean pitch error> <max pitch error> <mean confidence error>' from the info outlet",
         MIN_FUNCTION {
             if (!m_model_loaded) {
-                cout << "Cannot run test: No model loaded" << endl;
+                cout << "Cannot run test: " << no_model_reason() << endl;
                 return {};
             }
             
@@ -209,35 +449,28 @@ public:
                     test_buffer[i] = (float)rand() / RAND_MAX * 2.0f - 1.0f; // Random values between -1.0 and 1.0
                 }
                 
-                auto options = torch::TensorOptions().dtype(torch::kFloat32);
-                torch::Tensor input_tensor = torch::from_blob(test_buffer.data(), {1, (int)n_chunk_size}, options).clone();
-                
-                std::vector<torch::jit::IValue> inputs;
-                inputs.push_back(input_tensor);
-                
                 // Measure inference time
                 auto start_time = std::chrono::high_resolution_clock::now();
                 
                 // Run the model inference with mutex protection
-                torch::jit::IValue outputs;
+                PitchResult result;
                 {
                     std::lock_guard<std::mutex> lock(m_model_mutex);
-                    outputs = m_module.forward(inputs);
+                    std::copy(test_buffer.begin(), test_buffer.end(), m_test_session.input());
+                    m_test_session.run(&result);
                 }
                 
                 auto end_time = std::chrono::high_resolution_clock::now();
                 auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
                 
-                // Extract model outputs
-                auto output_tuple = outputs.toTuple();
-                float pitch = output_tuple->elements()[0].toTensor().item<float>();
-                float confidence = output_tuple->elements()[1].toTensor().item<float>();
-                float amplitude = output_tuple->elements()[2].toTensor().item<float>();
-                
                 // Print results
                 cout << "  Latency: " << duration.count() / 1000.0 << " ms" << endl;
+                if (m_warmup_passes > 0) {
+                    cout << "  Cold (first pass after load): " << m_cold_latency_ms << " ms, warm (after " << m_warmup_passes << " warm-up passes): " << m_warm_latency_ms << " ms" << endl;
+                }
+                start_accuracy_report();
             }
-            catch (const c10::Error& e) {
+            catch (const std::exception& e) {
                 cout << "Error during test inference: " << e.what() << endl;
             }
             
@@ -245,10 +478,210 @@ public:
         }
     };
 
+    message<> bench { this, "bench", "Benchmark every compatible model on a background thread. Reports min/median/p99/max latency, chunks per second and real-time factor for a single stream, batches of 2, 4 and 8 streams and 2 and 4 concurrent instances, to the Max console and as 'bench' lines from the info outlet, optionally also to a JSON file (relative paths are placed in the package folder). The fastest configuration that keeps up is then tuned for its thread count and stored as this machine's profile, see 'profile'. Usage: 'bench [iterations] [file.json]'",
+        MIN_FUNCTION {
+            if (m_bench_running) {
+                cout << "A benchmark is already running" << endl;
+                return {};
+            }
+            int iterations = args.size() > 0 ? std::max(int(args[0]), 1) : 200;
+            std::string json_path = args.size() > 1 ? std::string(args[1]) : std::string();
+            
+            // Max's path lookups stay on the main thread
+            fs::path json_file(json_path);
+            if (!json_file.empty() && json_file.is_relative()) json_file = m_package_directory / json_file;
+            fs::path profile_file = profile_path();
+            
+            if (m_bench_thread && m_bench_thread->joinable()) m_bench_thread->join();
+            m_bench_running = true;
+            m_bench_thread = std::make_unique<std::thread>([this, iterations, json_file, profile_file]() {
+                try {
+                    run_bench(iterations, json_file, profile_file);
+                }
+                catch (const std::exception& e) {
+                    cout << "Error during benchmark: " << e.what() << endl;
+                }
+                m_bench_running = false;
+            });
+            return {};
+        }
+    };
+
+    message<> profile { this, "profile", "Report the tuning profile new instances start from, written next to the models folder by the last 'bench' run: 'profile <chunk> <precision> <device> <threads> <p99 ms>' from the info outlet, or 'profile none'. It sets the chunk size (when the chunk argument is 0 or left out), @device and @optimize, and @precision and @threads when that chunk size is used. Arguments and attributes in the box override it. Use 'profile clear' to delete it",
+        MIN_FUNCTION {
+            if (args.size() > 0 && std::string(args[0]) == "clear") {
+                std::error_code error;
+                fs::remove(profile_path(), error);
+                cout << "Tuning profile cleared, new instances start from the defaults" << endl;
+                return {};
+            }
+            TuningProfile current = TuningProfile::read(profile_path());
+            if (!current.valid()) {
+                info_output.send(atoms { symbol("profile"), symbol("none") });
+                return {};
+            }
+            info_output.send(atoms { symbol("profile"), current.chunk_size, symbol(current.precision), symbol(current.device),
+                                     current.threads, current.p99_ms });
+            return {};
+        }
+    };
+
+    message<> stats { this, "stats", "Report runtime statistics from the info outlet: 'stats latency <p50> <p90> <p99> <max>' for inference time per chunk (ms), 'stats delay <p50> <p90> <p99> <max>' for the delay from the end of a chunk's audio to its result (ms), 'stats counts <inferences> <busy> <dropped chunks> <underruns> <errors> <coalesced results> <gated chunks>', 'stats queue <samples> <max samples> <capacity>' and 'stats input <rms> <peak>' for the last chunk of the first channel, after @dc and @gain. Use 'stats reset' to start over",
+        MIN_FUNCTION {
+            if (args.size() > 0 && std::string(args[0]) == "reset") {
+                reset_stats();
+                return {};
+            }
+            
+            auto summary = [](const LatencyHistogram& histogram) {
+                return atoms { histogram.percentile(0.5), histogram.percentile(0.9), histogram.percentile(0.99), histogram.max() };
+            };
+            atoms latency { symbol("stats"), symbol("latency") };
+            atoms delay { symbol("stats"), symbol("delay") };
+            for (const auto& value : summary(m_inference_latency)) latency.push_back(value);
+            for (const auto& value : summary(m_output_delay)) delay.push_back(value);
+            
+            int chunk_size = std::max(n_chunk_size, 1);
+            uint64_t dropped = (m_in_buffer.overruns() - m_stats_base_overruns) / chunk_size;
+            uint64_t underruns = m_in_buffer.underruns() - m_stats_base_underruns;
+            
+            info_output.send(latency);
+            info_output.send(delay);
+            info_output.send(atoms { symbol("stats"), symbol("counts"), static_cast<int>(m_stat_inferences.load()), static_cast<int>(m_stat_busy.load()),
+                               static_cast<int>(dropped), static_cast<int>(underruns), static_cast<int>(m_stat_errors.load()),
+                               static_cast<int>(m_stat_coalesced.load()), static_cast<int>(m_stat_gated.load()) });
+            info_output.send(atoms { symbol("stats"), symbol("queue"), static_cast<int>(m_in_buffer.available()),
+                               static_cast<int>(m_stat_queue_max.load()), static_cast<int>(m_in_buffer.size()) });
+            info_output.send(atoms { symbol("stats"), symbol("input"), m_input_rms.load(), m_input_peak.load() });
+            return {};
+        }
+    };
+
+    message<> latency { this, "latency", "Report from the info outlet how far results lag behind the audio they describe: 'latency <total ms> <window ms> <resampler ms> <compute ms> <total samples>'. The window is the chunk of audio that has to arrive before it can be analysed, the resampler's group delay applies while resampling, and compute is the measured median from the end of a window to its result leaving the inference thread (0 before the first result). The signal outlets lag by exactly two chunks plus the resampler delay",
+        MIN_FUNCTION {
+            double window_ms = m_model_loaded ? 1000.0 * n_chunk_size / m_model_samplerate : 0.0;
+            double resampler_ms = m_resampling ? m_resample_delay_ms : 0.0;
+            double compute_ms = m_output_delay.percentile(0.5);
+            double total_ms = window_ms + resampler_ms + compute_ms;
+            info_output.send(atoms { symbol("latency"), total_ms, window_ms, resampler_ms, compute_ms,
+                                     static_cast<int>(std::lround(1e-3 * total_ms * m_samplerate)) });
+            return {};
+        }
+    };
+
+    // Buffers used by the analyze message
+    buffer_reference m_analyze_source { this, MIN_FUNCTION { return {}; }, false };
+    buffer_reference m_analyze_targets[3] = {
+        { this, MIN_FUNCTION { return {}; }, false },
+        { this, MIN_FUNCTION { return {}; }, false },
+        { this, MIN_FUNCTION { return {}; }, false }
+    };
+
+    message<> analyze { this, "analyze", "Analyse a whole buffer~ on a background thread, faster than real time, with the current model (or, before DSP has started, the model matching the buffer's sample rate). @dc, @gain, @gate, @conf, @amp, @smooth and @hyst apply as they do live. One value per chunk is written to the pitch, confidence and amplitude buffer~s if given (they are resized), or otherwise to the dict '<buffer>.pesto' as 'time' (ms), 'pitch', 'confidence' and 'amplitude' arrays. Sends 'analyze done <buffer>' from the info outlet when finished. Usage: 'analyze <buffer> [<pitch> <confidence> <amplitude>]'",
+        MIN_FUNCTION {
+            if (args.size() != 1 && args.size() != 4) {
+                cout << "Usage: analyze <buffer> [<pitch buffer> <confidence buffer> <amplitude buffer>]" << endl;
+                return {};
+            }
+            if (m_analyze_running) {
+                cout << "An analysis is already running" << endl;
+                return {};
+            }
+            
+            // Copy the buffer here, mixed down to mono, so Max may edit it meanwhile
+            std::vector<float> audio;
+            double buffer_samplerate = 0.0;
+            m_analyze_source.set(args[0]);
+            {
+                buffer_lock<false> source(m_analyze_source);
+                if (!source.valid()) {
+                    cout << "Cannot analyze: buffer~ " << std::string(args[0]) << " not found" << endl;
+                    return {};
+                }
+                size_t channels = std::max<size_t>(source.channel_count(), 1);
+                audio.resize(source.frame_count());
+                for (size_t frame = 0; frame < audio.size(); ++frame) {
+                    float sum = 0.0f;
+                    for (size_t channel = 0; channel < channels; ++channel) sum += source.lookup(frame, channel);
+                    audio[frame] = sum / channels;
+                }
+                buffer_samplerate = source.samplerate() > 0.0 ? source.samplerate() : m_samplerate;
+            }
+            
+            // The loaded model, or one is loaded for the buffer's rate on the analysis thread
+            std::shared_ptr<const ModelCache::Entry> model;
+            int chunk_size = 0;
+            double model_samplerate = 0.0;
+            {
+                std::lock_guard<std::mutex> lock(m_model_mutex);
+                if (m_model_loaded) {
+                    model = m_model;
+                    chunk_size = n_chunk_size;
+                    model_samplerate = m_model_samplerate;
+                }
+            }
+            
+            OfflineAnalyzer::Settings settings;
+            settings.remove_dc = m_remove_dc;
+            settings.gain = m_input_gain;
+            settings.gate = static_cast<float>(m_gate_threshold);
+            settings.confidence = static_cast<float>(m_confidence_threshold);
+            settings.amplitude = static_cast<float>(m_amplitude_threshold);
+            settings.tracker = PitchTracker::Settings { m_median_frames, m_hysteresis, false, 1 };
+            int target_chunk = static_cast<int>(m_target_chunk);
+            
+            m_analysis.source = args[0];
+            for (int k = 0; k < 3; ++k) {
+                m_analysis.targets[k] = args.size() == 4 ? symbol(args[k + 1]) : symbol("");
+            }
+            m_analysis.results.clear();
+            
+            if (m_analyze_thread && m_analyze_thread->joinable()) m_analyze_thread->join();
+            m_analyze_running = true;
+            m_analyze_thread = std::make_unique<std::thread>([this, audio = std::move(audio), buffer_samplerate, model, chunk_size,
+                                                              model_samplerate, settings, target_chunk]() mutable {
+                torch::NoGradGuard no_grad;
+                if (int threads = m_intra_threads.load()) at::set_num_threads(threads);
+                try {
+                    if (!model && !load_analysis_model(buffer_samplerate, target_chunk, model, chunk_size, model_samplerate)) {
+                        cout << "Cannot analyze: no compatible model for " << buffer_samplerate / 1000.0 << "kHz" << endl;
+                        m_analyze_running = false;
+                        return;
+                    }
+                    m_analysis.period_ms = 1000.0 * chunk_size / model_samplerate;
+                    if (std::abs(buffer_samplerate - model_samplerate) >= 1.0) {
+                        audio = resample_offline(audio, buffer_samplerate, model_samplerate);
+                    }
+                    OfflineAnalyzer analyzer(model, chunk_size, m_analyze_cancel, settings);
+                    if (analyzer.run(audio, m_analysis.results)) {
+                        deliver_analysis.set();
+                        return;
+                    }
+                }
+                catch (const std::exception& e) {
+                    cout << "Error during analysis: " << e.what() << endl;
+                }
+                m_analyze_running = false;
+            });
+            return {};
+        }
+    };
+
+    // Write a finished analysis to its buffers or dict on the main thread
+    queue<> deliver_analysis { this,
+        MIN_FUNCTION {
+            if (m_analyze_thread && m_analyze_thread->joinable()) m_analyze_thread->join();
+            write_analysis();
+            m_analyze_running = false;
+            info_output.send(atoms { symbol("analyze"), symbol("done"), m_analysis.source });
+            return {};
+        }
+    };
+
     message<> freq { this, "freq", "Test with a chunk of sinusoidal audio. Test model with a single chunk of sine wave input at specified frequency (Hz) to test accuracy. Usage: 'freq 440'",
     MIN_FUNCTION {
         if (!m_model_loaded) {
-            cout << "Cannot run frequency test: No model loaded" << endl;
+            cout << "Cannot run frequency test: " << no_model_reason() << endl;
             return {};
         }
         
@@ -263,7 +696,7 @@ public:
             // Generate sine wave at specified frequency
             std::vector<float> sine_buffer(n_chunk_size);
             float phase = m_saved_phase; // Start from previous phase
-            float phase_increment = 2.0f * M_PI * frequency / m_samplerate;
+            float phase_increment = 2.0f * M_PI * frequency / m_model_samplerate;
             
             for (int i = 0; i < n_chunk_size; i++) {
                 sine_buffer[i] = sin(phase);
@@ -276,37 +709,26 @@ public:
             // Save the phase for next call
             m_saved_phase = phase;
             
-            // Create tensor and run model inference
-            auto options = torch::TensorOptions().dtype(torch::kFloat32);
-            torch::Tensor input_tensor = torch::from_blob(sine_buffer.data(), {1, (int)n_chunk_size}, options).clone();
-            
-            std::vector<torch::jit::IValue> inputs;
-            inputs.push_back(input_tensor);
-            
             auto start_time = std::chrono::high_resolution_clock::now();
             
             // Run model inference with mutex protection
-            torch::jit::IValue outputs;
+            PitchResult result;
             {
                 std::lock_guard<std::mutex> lock(m_model_mutex);
-                outputs = m_module.forward(inputs);
+                std::copy(sine_buffer.begin(), sine_buffer.end(), m_test_session.input());
+                m_test_session.run(&result);
             }
             
             auto end_time = std::chrono::high_resolution_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
-            
-            // Extract model outputs
-            auto output_tuple = outputs.toTuple();
-            float pitch = output_tuple->elements()[0].toTensor().item<float>();
-            float confidence = output_tuple->elements()[1].toTensor().item<float>();
-            float amplitude = output_tuple->elements()[2].toTensor().item<float>();
+            float pitch = result.pitch;
             
             // Output a single line with the results
             // Convert MIDI note to Hz using the formula: Hz = 440 * 2^((midi-69)/12)
             float pitchHz = 440.0f * pow(2.0f, (pitch - 69.0f) / 12.0f);
             cout << "Freq test: input=" << frequency << "Hz, output=" << pitchHz << "Hz, latency=" << duration.count()/1000.0 << "ms" << endl;
         }
-        catch (const c10::Error& e) {
+        catch (const std::exception& e) {
             cout << "Error during frequency test: " << e.what() << endl;
         }
         
@@ -316,7 +738,13 @@ public:
 
     // Process incoming audio and collect into buffer
     void operator()(audio_bundle input, audio_bundle output) {
+        size_t frames = input.frame_count();
+        
+        if (!m_dsp_active || !m_model_loaded) {
+            clear_signal_outputs(output, frames);
+        }
         if (!m_dsp_active) return;
+        m_host_samples += frames;
         
         // Count audio frames regardless of model state
         if (!m_model_loaded) {
@@ -335,102 +763,272 @@ public:
             m_error_reported = false;
         }
         
-        auto in = input.samples(0);
+        // Keep away from the ring and resamplers while a model swap resizes them
+        if (int hold = m_audio_hold.load(std::memory_order_acquire)) {
+            // Only acknowledge a hold that hasn't been withdrawn in the meantime (hold is then 0)
+            if (hold == k_hold_requested) {
+                m_audio_hold.compare_exchange_strong(hold, k_hold_acknowledged, std::memory_order_acq_rel);
+            }
+            if (hold) {
+                hold_signal_outputs(output, frames);
+                return;
+            }
+        }
+        
+        const double* in[k_max_channels];
+        for (int channel = 0; channel < m_channels; ++channel) {
+            in[channel] = input.samples(channel);
+        }
+        size_t vector_start = m_in_buffer.write_position();
         
-        for (auto i = 0; i < input.frame_count(); ++i) {
-            // Add sample to circular buffer
-            m_in_buffer.put(in[i]);
+        // Add the whole vector to the circular buffer in one block, converted to the
+        // model's sample rate first if needed
+        m_in_buffer.set_policy(static_cast<CircularBuffer::OverrunPolicy>(overrun.get()));
+        if (m_resampling) {
+            float* converted[k_max_channels];
+            for (size_t offset = 0; offset < frames; offset += PolyphaseResampler::k_max_block) {
+                size_t count = std::min(frames - offset, PolyphaseResampler::k_max_block);
+                size_t produced = 0;
+                for (int channel = 0; channel < m_channels; ++channel) {
+                    converted[channel] = m_resample_buffers[channel].data();
+                    produced = m_resamplers[channel].process(in[channel] + offset, count, converted[channel]);
+                }
+                m_in_buffer.put(static_cast<const float* const*>(converted), produced);
+            }
+        } else {
+            m_in_buffer.put(in, frames);
         }
         
-        // Check if we have enough samples and inference thread is ready
-        if (m_in_buffer.available() >= n_chunk_size && m_result_ready.try_acquire()) {
-            // Signal inference thread that data is ready
-            m_data_ready.release();
+        m_last_put_position.store(m_in_buffer.write_position(), std::memory_order_relaxed);
+        m_last_put_time.store(std::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+        publish_put_stamp(m_in_buffer.stream_position(m_in_buffer.write_position()));
+        
+        write_signal_outputs(output, vector_start, frames);
+        
+        // Wake the inference thread once a chunk is complete. It drains every window
+        // available per wakeup, so a wakeup still pending means it is behind.
+        if (m_in_buffer.available() >= n_chunk_size && !wake_inference()) {
+            m_stat_busy.fetch_add(1, std::memory_order_relaxed);
         }
     }
 
-    pesto() : m_data_ready(0), m_result_ready(1), m_should_stop(false) {
-        // Disable gradient computation for better inference performance
+    pesto(const atoms& args = {}) : m_wake(0), m_should_stop(false) {
+        // Grad mode is per thread: this covers the main thread for the object's lifetime,
+        // the inference, loader, bench and analysis threads each disable it themselves
         static torch::NoGradGuard no_grad;
         
+        // One signal inlet per channel after the first
+        int channels = args.size() > 1 ? int(args[1]) : 1;
+        m_channels = std::clamp(channels, 1, k_max_channels);
+        for (int channel = 1; channel < m_channels; ++channel) {
+            m_channel_inputs.push_back(std::make_unique<inlet<>>(this, "(signal) audio input channel " + std::to_string(channel + 1)));
+        }
+        m_results.resize(m_channels);
+        m_trackers.resize(m_channels);
+        m_candidate_pickers.resize(m_channels);
+        for (auto& list : m_output_lists) {
+            list.resize(m_channels);
+        }
+        
         m_model_loaded = false;
         n_chunk_size = 512; 
         m_samplerate = 44100.0;
+        m_model_samplerate = 44100.0;
+        m_resampling = false;
+        m_resample_ratio = 1.0;
         m_dsp_active = false;
         m_confidence_threshold = 0.0;
         m_amplitude_threshold = 0.0;
+        m_batch_enabled = false;
+        m_batch_warned = false;
+        m_hop_request = 0;
+        m_hop_size = n_chunk_size;
+        m_overrun_reported = false;
+        m_hop_phase = 0;
         m_model_path = symbol("");
         m_target_chunk = 0; 
         m_saved_phase = 0.0f; 
         m_error_reported = false;
         m_audio_frames_without_model = 0;
         
-        // Initialize buffers
-        int buffer_size = power_ceil(std::max(n_chunk_size, 4096));
-        m_in_buffer.resize(buffer_size);
-        m_model_input_buffer = std::make_unique<float[]>(1024); // Max chunk size
+        // Max's path lookups stay on the main thread, the other threads use these
+        m_package_directory = get_package_directory();
+        m_models_directories = get_models_directories();
+        apply_profile();
         
-        // Pre-create tensor options
-        m_tensor_options = torch::TensorOptions().dtype(torch::kFloat32);
+        // Initialize buffers
+        int buffer_size = power_ceil(std::max(4 * n_chunk_size, 4096));
+        m_in_buffer.resize(buffer_size, m_channels);
         
-        // Start inference thread
+        // Start inference thread. It sleeps until audio completes a chunk or the loader
+        // has a model to swap in, so it is parked for as long as DSP is off.
         m_inference_thread = std::make_unique<std::thread>([this]() {
-            while (!m_should_stop.load()) {
-                if (m_data_ready.try_acquire_for(std::chrono::milliseconds(100))) {
-                    run_inference();
-                    m_result_ready.release();
+            torch::NoGradGuard no_grad;
+            if (m_thread_settings_changed.exchange(false)) {
+                apply_thread_settings();
+            }
+            while (true) {
+                m_wake.acquire();
+                if (m_should_stop.load()) break;
+                m_wake_pending.store(false, std::memory_order_seq_cst);
+                if (m_swap_pending.load(std::memory_order_acquire)) {
+                    apply_pending_model();
                 }
+                // Thread attributes changed while parked take effect at the next wakeup
+                if (m_thread_settings_changed.exchange(false)) {
+                    apply_thread_settings();
+                }
+                run_inference();
             }
         });
+        
+        // Start loader thread
+        m_loader_thread = std::make_unique<std::thread>([this]() { run_loader(); });
     }
     
     ~pesto() {
+        // Stop a running benchmark or analysis
+        m_bench_cancel = true;
+        m_analyze_cancel = true;
+        if (m_bench_thread && m_bench_thread->joinable()) {
+            m_bench_thread->join();
+        }
+        if (m_analyze_thread && m_analyze_thread->joinable()) {
+            m_analyze_thread->join();
+        }
+        
+        // Stop the loader first so it can't publish another model
+        {
+            std::lock_guard<std::mutex> lock(m_loader_mutex);
+            m_loader_stop = true;
+        }
+        m_loader_wake.notify_one();
+        if (m_loader_thread && m_loader_thread->joinable()) {
+            m_loader_thread->join();
+        }
+        
         // Signal thread to stop
         m_should_stop = true;
-        m_data_ready.release(); // Wake up thread
+        m_wake.release(); // Wake up thread
         
         // Wait for thread to finish
         if (m_inference_thread && m_inference_thread->joinable()) {
             m_inference_thread->join();
         }
+        
+        // No more results can be queued, stop a pending delivery
+        deliver_results.stop();
+        
+        // Leave the batch group only once the inference thread can no longer use it
+        m_batch_member.reset();
     }
 
-    // Initialize the model based on current settings
+    // A model prepared by the loader thread, waiting to be swapped in at a chunk boundary
+    struct PendingModel {
+        std::shared_ptr<const ModelCache::Entry> model;
+        std::vector<ChannelSession> sessions; // One per hop phase, already warmed up
+        ModelSession test_session;
+        std::string name;
+        int chunk_size = 0;
+        int hop_size = 0;
+        double samplerate = 0.0;
+        int warmup_passes = 0;
+        double cold_latency_ms = 0.0; // First forward after load
+        double warm_latency_ms = 0.0; // Last warm-up forward
+    };
+    
+    struct LoadRequest {
+        symbol model_path; // Specific model file, or empty for the best match
+        int target_chunk;  // Preferred chunk size, 0 for the smallest
+        int step = 0;      // @auto: the next larger (1) or smaller (-1) chunk than target_chunk
+        bool rehop = false; // @hop: the loaded model again, with sessions for the new hop
+    };
+    
+    // Ask the loader thread for a model matching the current settings. Loading, session
+    // setup and warm-up happen in the background, the result is swapped in by the
+    // inference thread at the next chunk boundary while the current model keeps running.
+    // Until dspsetup reports the host sample rate the request is only recorded: the
+    // arguments, model and chunk messages of a patch being opened all resolve to a
+    // single load when DSP starts.
     void initialize_model() {
-        // Temporarily disable model processing during model change
-        bool was_loaded = m_model_loaded;
-        m_model_loaded = false;
-        
-        // Clear buffers to prevent size mismatches
-        clear_buffer();
-        
-        // If a specific model path was provided, load it
-        if (m_model_path != symbol("")) {
-            cout << "Loading specified model: " << m_model_path << endl;
-            std::string model_file_str = m_model_path;
-            m_model_loaded = load_model(model_file_str);
-            
-            // If loading fails, fall back to best matching model
-            if (!m_model_loaded) {
-                cout << "Failed to load specified model, falling back to best match" << endl;
-                load_best_model();
-            }
-        } 
-        // Otherwise, find the best matching model based on chunk size preference
-        else {
-            load_best_model();
+        if (!m_rate_known) return;
+        m_requested_samplerate = m_samplerate;
+        {
+            std::lock_guard<std::mutex> lock(m_loader_mutex);
+            m_load_request = LoadRequest { m_model_path, static_cast<int>(m_target_chunk) };
         }
+        m_loader_wake.notify_one();
+    }
+    
+    // Overlapping windows can't share one streaming state, so a hop of chunk/K runs K
+    // copies of the model, each fed a contiguous stream of chunks offset by one hop. A new
+    // hop prepares the loaded model again on the loader, so every phase is warmed up and
+    // captured like after a load. A load already waiting picks up the hop by itself.
+    void request_hop_change() {
+        if (!m_rate_known || !m_model_loaded) return;
+        {
+            std::lock_guard<std::mutex> lock(m_loader_mutex);
+            if (m_load_request) return;
+            m_load_request = LoadRequest { symbol(""), 0, 0, true };
+        }
+        m_loader_wake.notify_one();
+    }
+
+    const char* no_model_reason() const {
+        return m_rate_known ? "No model loaded" : "No model loaded yet, models are loaded when DSP starts";
+    }
+
+    // The package root, two directories up from the external, empty if it can't be found.
+    // Uses Max's path lookup, so it is only called on the main thread, see m_package_directory.
+    fs::path get_package_directory() {
+        path external_path = path("pesto~", path::filetype::external);
+        std::string path_str = external_path;
+        if (!external_path) return {};
+        return fs::path(path_str).parent_path().parent_path();
+    }
+
+    // This machine's tuning profile, in the package folder next to the models folder.
+    // Empty if the package can't be found.
+    fs::path profile_path() {
+        return m_package_directory.empty() ? fs::path() : m_package_directory / TuningProfile::k_filename;
+    }
+
+    // Start from the tuning profile of the last bench run on this machine. Called from the
+    // constructor, so the chunk argument and the box's attributes are applied after it.
+    void apply_profile() {
+        m_profile = TuningProfile::read(profile_path());
+        if (!m_profile.valid()) return;
         
-        // Resize buffer if chunk size changed and model loaded successfully
-        if (m_model_loaded) {
-            int buffer_size = power_ceil(std::max(n_chunk_size, 4096));
-            m_in_buffer.resize(buffer_size);
+        static const char* const device_names[] = { "cpu", "mps", "cuda" };
+        for (int i = 0; i < 3; ++i) {
+            if (m_profile.device == device_names[i]) device = static_cast<devices>(i);
         }
+        optimize = m_profile.optimize;
+        m_target_chunk = m_profile.chunk_size;
+        use_profile_tuning(true);
+    }
+    
+    // The profile's precision and thread count were measured at its chunk size. Take them
+    // when that chunk size is used, and go back to the defaults when the chunk argument
+    // picks another one.
+    void use_profile_tuning(bool use) {
+        if (!m_profile.valid()) return;
+        precisions profile_precision = precisions::fp32;
+        static const char* const precision_names[] = { "fp32", "fp16", "bf16", "int8" };
+        for (int i = 0; i < 4; ++i) {
+            if (m_profile.precision == precision_names[i]) profile_precision = static_cast<precisions>(i);
+        }
+        precision = use ? profile_precision : precisions::fp32;
+        threads = use ? m_profile.threads : 0;
     }
 
-    // Add this method to get the package models directories
+    // The directories searched for models. They are looked up, and the models folder
+    // created, once per process, from the first constructor on the main thread.
     std::vector<std::string> get_models_directories() {
-        std::vector<std::string> directories;
+        static std::mutex mutex;
+        static std::vector<std::string> directories;
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!directories.empty()) return directories;
         try {
             // Get the path to the external
             path external_path = path("pesto~", path::filetype::external);
@@ -443,8 +1041,7 @@ public:
                     directories.push_back(external_dir.string());
                 }
                 
-                // Go up two directories from the external to reach the package root
-                fs::path package_path = fs::path(path_str).parent_path().parent_path();
+                fs::path package_path = m_package_directory;
                 
                 // Add both models and other directories
                 fs::path models_path = package_path / "models";
@@ -469,186 +1066,1161 @@ public:
         return directories;
     }
 
-    bool load_model(const std::string& model_file_str) {
+    // The current model index of the models directories (any thread)
+    std::shared_ptr<const ModelIndex::Snapshot> model_index(bool rescan = false) {
+        return ModelIndex::snapshot(m_models_directories, rescan);
+    }
+
+    // Full path of a model file in the first models directory that has it, empty if none
+    std::string find_model_path(const std::string& model_file_str) {
+        auto index = model_index();
+        const ModelIndex::ModelFile* model = index->find(model_file_str);
+        if (!model) {
+            // Added within the directory timestamp resolution, or not yet indexed
+            index = model_index(true);
+            model = index->find(model_file_str);
+        }
+        return model ? model->path : std::string();
+    }
+
+    // The torch device for the device attribute, the CPU if it isn't available
+    torch::Device resolve_device() {
+        devices requested = device;
+        if (requested == devices::cuda) {
+            if (torch::cuda::is_available()) return torch::kCUDA;
+            cout << "CUDA is not available, running on the CPU" << endl;
+        } else if (requested == devices::mps) {
+            if (torch::mps::is_available()) return torch::kMPS;
+            cout << "MPS is not available, running on the CPU" << endl;
+        }
+        return torch::kCPU;
+    }
+
+    // Load a model file and build its streaming sessions (loader thread)
+    bool prepare_model(const std::string& model_file_str, PendingModel& prepared) {
         try {
             if (model_file_str.empty()) {
                 cout << "Model path is empty" << endl;
                 return false;
             }
 
-            auto models_dirs = get_models_directories();
-            if (models_dirs.empty()) {
-                cout << "No models directories found" << endl;
+            std::string full_path = find_model_path(model_file_str);
+            if (full_path.empty()) {
+                cout << "Model file not found in any models directory: " << model_file_str << endl;
                 return false;
             }
-
-            // Try to find the model in any of the directories
-            std::string full_path;
-            bool found = false;
             
-            for (const auto& dir : models_dirs) {
-                std::string candidate_path = dir + "/" + model_file_str;
-                if (fs::exists(candidate_path)) {
-                    full_path = candidate_path;
-                    found = true;
-                    break;
-                }
+            // Load the new model first (outside of the critical section), sharing the
+            // weights with any other instance that already has this file open
+            ModelIndex::ModelFile tags = ModelIndex::parse(full_path);
+            auto new_model = ModelCache::acquire(full_path, optimize, resolve_device(), ModelIndex::precision_dtype(tags.precision), mmap_weights);
+            if (!new_model->warning().empty()) cout << new_model->warning() << endl;
+            // Untagged models keep the current chunk size and the host sample rate
+            int new_chunk_size = tags.chunk_size > 0 ? tags.chunk_size : n_chunk_size;
+            double new_samplerate = tags.rate_tag > 0 ? ModelIndex::rate_from_tag(tags.rate_tag) : double(m_samplerate);
+            if (resample == resample_modes::off && ModelIndex::rate_from_tag(static_cast<int>(m_samplerate / 1000)) != new_samplerate) {
+                cout << "Warning: model expects " << new_samplerate << "Hz but Max runs at " << m_samplerate << "Hz, enable @resample to convert" << endl;
+                new_samplerate = m_samplerate;
             }
             
-            if (!found) {
-                cout << "Model file not found in any models directory: " << model_file_str << endl;
-                return false;
+            // Preallocate the input tensors for this model's chunk size, one session per
+            // hop phase, and run silence through them so they start from a settled state
+            int new_hop = effective_hop(new_chunk_size);
+            int passes = warmup;
+            prepared.sessions.clear();
+            for (int phase = 0; phase < new_chunk_size / new_hop; ++phase) {
+                prepared.sessions.emplace_back(new_model, new_chunk_size, m_channels);
+                auto [cold_ms, warm_ms] = warm_up(prepared.sessions.back(), new_chunk_size, passes);
+                prepared.sessions.back().capture(); // bang resets to the settled state
+                if (phase == 0) {
+                    prepared.cold_latency_ms = cold_ms;
+                    prepared.warm_latency_ms = warm_ms;
+                }
             }
-            
-            // Load the new model first (outside of the critical section)
-            torch::jit::script::Module new_module = torch::jit::load(full_path);
-            new_module.eval();
-            
-            // Extract chunk size from filename before updating anything
-            int new_chunk_size = n_chunk_size; // Default to current
-            try {
-                std::regex pattern(".*h(\\d+)\\.pt$");
-                std::smatch matches;
-                if (std::regex_search(model_file_str, matches, pattern) && matches.size() > 1) {
-                    new_chunk_size = std::stoi(matches[1].str());
+            prepared.warmup_passes = passes;
+            prepared.test_session = ModelSession(*new_model, new_chunk_size);
+            if (passes > 0) {
+                // Keep the test session's state as settled as the streaming sessions'
+                for (int i = 0; i < passes; ++i) {
+                    std::fill_n(prepared.test_session.input(), new_chunk_size, 0.0f);
+                    PitchResult result;
+                    prepared.test_session.run(&result);
                 }
-            } catch (...) {
-                // Keep default chunk size if extraction fails
             }
+            prepared.name = model_file_str;
+            prepared.chunk_size = new_chunk_size;
+            prepared.hop_size = new_hop;
+            prepared.samplerate = new_samplerate;
+            prepared.model = std::move(new_model);
             
-            // Now safely replace the model with proper synchronization
-            {
-                std::lock_guard<std::mutex> lock(m_model_mutex);
-                m_module = std::move(new_module);
-                n_chunk_size = new_chunk_size;
+            cout << "Model loaded successfully - Chunk size = " << new_chunk_size << ", precision = " << tags.precision << endl;
+            if (prepared.model.use_count() > 1) {
+                cout << "Sharing model weights with " << prepared.model.use_count() - 1 << " other instance(s)" << endl;
             }
-            
-            cout << "Model loaded successfully - Chunk size = " << n_chunk_size << endl;
-            clear_buffer();
             return true;
         }
         catch (const c10::Error& e) {
             cout << "Error loading the model: " << e.what() << endl;
             return false;
         }
+        catch (const fs::filesystem_error& e) {
+            cout << "Error resolving the model path: " << e.what() << endl;
+            return false;
+        }
+        catch (const std::exception& e) {
+            cout << "Error preparing the model: " << e.what() << endl;
+            return false;
+        }
     }
 
-    // Find all compatible models in the models directory
-    std::vector<std::pair<std::string, int>> find_compatible_models() {
-        std::vector<std::pair<std::string, int>> compatible_models;
-        auto models_dirs = get_models_directories();
-        
-        if (models_dirs.empty()) return compatible_models;
+    // Precisions to use, most preferred first. 'auto' picks the usually fastest variant
+    // for the device: int8 (CPU only) or fp32 on the CPU, half precision on a GPU.
+    std::vector<std::string> precision_preference() {
+        switch (static_cast<precisions>(precision)) {
+            case precisions::fp16: return { "fp16", "fp32" };
+            case precisions::bf16: return { "bf16", "fp32" };
+            case precisions::int8: return { "int8", "fp32" };
+            case precisions::automatic:
+                if (static_cast<devices>(device) == devices::cpu) return { "int8", "fp32", "bf16", "fp16" };
+                return { "fp16", "bf16", "fp32" };
+            default: return { "fp32" };
+        }
+    }
 
-        for (const auto& models_dir : models_dirs) {
-            for (const auto& entry : fs::directory_iterator(models_dir)) {
-                if (entry.path().extension() == ".pt") {
-                    std::string filename = entry.path().filename().string();
-                    std::regex pattern(".*sr(\\d+)k.*h(\\d+)\\.pt$");
-                    std::smatch matches;
-                    
-                    if (std::regex_search(filename, matches, pattern) && matches.size() > 2) {
-                        int model_sr = std::stoi(matches[1].str());
-                        int chunk_size = std::stoi(matches[2].str());
-                        
-                        // Check if sample rate matches
-                        if (model_sr == static_cast<int>(m_samplerate / 1000)) {
-                            compatible_models.push_back({filename, chunk_size});
-                        }
-                    }
+    // Find all compatible models in the models directory. Models at the host sample rate
+    // are preferred, otherwise (or always with @resample on) the models closest to 44.1kHz
+    // are used and the input is resampled to their rate. Of the precision variants of a
+    // chunk size only the one @precision prefers is returned, unless all are asked for,
+    // and an ONNX export wins over the TorchScript file of the same variant. A chunk size
+    // above 0 only returns the models of that size, looked up in the index. The models
+    // suit the host rate, or another one, such as a buffer~'s, when it is given.
+    std::vector<ModelIndex::ModelFile> find_compatible_models(bool all_precisions = false, int chunk_size = 0,
+                                                             double samplerate = 0.0) {
+        std::vector<ModelIndex::ModelFile> compatible_models;
+        auto index = model_index();
+        auto tagged = [](const ModelIndex::ModelFile& model) { return model.rate_tag > 0 && model.chunk_size > 0; };
+        
+        // Pick the sample rate to run at
+        int host_sr = static_cast<int>((samplerate > 0.0 ? samplerate : double(m_samplerate)) / 1000);
+        resample_modes mode = resample;
+        const auto& all_models = index->files();
+        bool native = std::any_of(all_models.begin(), all_models.end(),
+                                  [&](const auto& model) { return tagged(model) && model.rate_tag == host_sr; });
+        int target_sr = host_sr;
+        
+        if (mode == resample_modes::on || (mode == resample_modes::automatic && !native)) {
+            double best_distance = std::numeric_limits<double>::max();
+            for (const auto& model : all_models) {
+                if (!tagged(model)) continue;
+                double distance = std::abs(ModelIndex::rate_from_tag(model.rate_tag) - 44100.0);
+                if (distance < best_distance) {
+                    target_sr = model.rate_tag;
+                    best_distance = distance;
+                }
+            }
+        }
+        
+        auto add = [&](const ModelIndex::ModelFile& model) {
+            if (tagged(model) && model.rate_tag == target_sr) compatible_models.push_back(model);
+        };
+        if (chunk_size > 0) {
+            for (size_t i : index->with_chunk(chunk_size)) add(all_models[i]);
+        } else {
+            for (const auto& model : all_models) add(model);
+        }
+        
+        // Keep the most preferred precision per chunk size
+        if (!all_precisions) {
+            auto preference = precision_preference();
+            auto rank = [&preference](const ModelIndex::ModelFile& model) {
+                auto it = std::find(preference.begin(), preference.end(), model.precision);
+                return static_cast<int>(it - preference.begin());
+            };
+            std::vector<ModelIndex::ModelFile> preferred;
+            for (const auto& model : compatible_models) {
+                if (rank(model) == static_cast<int>(preference.size())) continue;
+                auto it = std::find_if(preferred.begin(), preferred.end(),
+                                       [&model](const auto& other) { return other.chunk_size == model.chunk_size; });
+                if (it == preferred.end()) {
+                    preferred.push_back(model);
+                } else if (rank(model) < rank(*it) ||
+                           (rank(model) == rank(*it) && fs::path(model.filename).extension() == ".onnx")) {
+                    *it = model;
                 }
             }
+            compatible_models.swap(preferred);
         }
         
         // Sort by chunk size
-        std::sort(compatible_models.begin(), compatible_models.end(),
-                 [](const auto& a, const auto& b) { return a.second < b.second; });
+        std::stable_sort(compatible_models.begin(), compatible_models.end(),
+                         [](const auto& a, const auto& b) { return a.chunk_size < b.chunk_size; });
         
         return compatible_models;
     }
 
-    // Load the best matching model
-    void load_best_model() {
-        auto compatible_models = find_compatible_models();
+    // Set up sample rate conversion from the host rate to the loaded model's rate
+    // (called when DSP is set up and after a model load, while audio is not processed)
+    void configure_resampler() {
+        m_resampling = false;
+        m_resample_ratio = 1.0;
+        if (!m_model || std::abs(m_model_samplerate - m_samplerate) < 1.0) return;
         
-        if (compatible_models.empty()) {
-            cout << "No compatible models found for sample rate " << m_samplerate / 1000 << "kHz" << endl;
-            return;
+        m_resamplers.assign(m_channels, PolyphaseResampler());
+        m_resample_buffers.resize(m_channels);
+        for (int channel = 0; channel < m_channels; ++channel) {
+            m_resamplers[channel].configure(m_samplerate, m_model_samplerate);
+            m_resample_buffers[channel].assign(m_resamplers[channel].max_output(PolyphaseResampler::k_max_block), 0.0f);
         }
+        m_resample_ratio = m_model_samplerate / m_samplerate;
+        m_resample_delay_ms = 1000.0 * m_resamplers.front().group_delay() / m_samplerate;
+        m_resampling = true;
+        
+        cout << "Resampling " << m_samplerate << "Hz to " << m_model_samplerate << "Hz, group delay " << m_resample_delay_ms << " ms" << endl;
+    }
 
+    // Load the best matching model (loader thread)
+    bool prepare_best_model(int target_chunk, PendingModel& prepared) {
         // Try to find model matching requested chunk size if specified (non-zero)
-        int target_chunk = m_target_chunk;
-        
         if (target_chunk > 0) {
-            auto it = std::find_if(compatible_models.begin(), compatible_models.end(),
-                                [target_chunk](const auto& model) { return model.second == target_chunk; });
-            
-            if (it != compatible_models.end()) {
-                m_model_loaded = load_model(it->first);
-                return;
+            auto matching = find_compatible_models(false, target_chunk);
+            if (!matching.empty()) {
+                return prepare_model(matching.front().filename, prepared);
             }
-            
-            cout << "No model found with chunk size " << target_chunk << endl;
         }
         
+        auto compatible_models = find_compatible_models();
+        if (compatible_models.empty()) {
+            cout << "No compatible models found for sample rate " << m_samplerate / 1000 << "kHz" << endl;
+            return false;
+        }
+        if (target_chunk > 0) cout << "No model found with chunk size " << target_chunk << endl;
+        
         // If we reach here, we're falling back to the smallest chunk size
-        m_model_loaded = load_model(compatible_models[0].first);
+        return prepare_model(compatible_models[0].filename, prepared);
+    }
+    
+    // The compatible model with the next larger (step 1) or smaller (step -1) chunk size
+    std::optional<ModelIndex::ModelFile> adjacent_model(int chunk_size, int step) {
+        auto compatible_models = find_compatible_models();
+        if (step > 0) {
+            for (const auto& model : compatible_models) {
+                if (model.chunk_size > chunk_size) return model;
+            }
+        } else {
+            for (auto it = compatible_models.rbegin(); it != compatible_models.rend(); ++it) {
+                if (it->chunk_size < chunk_size) return *it;
+            }
+        }
+        return std::nullopt;
     }
 
 private:
     int n_chunk_size;           // Size of the audio chunks for model inference
     number m_samplerate;        // Current sample rate
+    number m_model_samplerate;  // Sample rate the loaded model was exported at
+    bool m_resampling;          // Converting host audio to the model's sample rate
+    double m_resample_ratio;    // Model samples per host sample
+    double m_resample_delay_ms = 0.0; // Group delay added by the resampler
+    std::vector<PolyphaseResampler> m_resamplers;      // One per channel
+    std::vector<std::vector<float>> m_resample_buffers; // Converted audio, one per channel
     int m_vectorsize;           // Current vector size
     bool m_dsp_active;          // Flag indicating if DSP is active
     number m_confidence_threshold; // Confidence threshold for pitch output
     number m_amplitude_threshold;  // Amplitude threshold for pitch output
+    bool m_remove_dc = false;      // Subtract each chunk's mean before inference
+    float m_input_gain = 1.0f;     // Gain applied before inference
+    number m_gate_threshold = 0.0; // RMS below which chunks skip inference, 0 for off
+    bool m_gate_closed = false;    // Every channel was below the gate at the last chunk
+    int m_median_frames = 1;       // Running median length, see @smooth
+    float m_hysteresis = 0.0f;     // Semitones, see @hyst
+    bool m_notes_enabled = false;  // Segment notes, see @notes
+    number m_note_min_ms = 40.0;   // Minimum note (and rest) duration
+    std::atomic<int> m_poly_count { 0 }; // Candidates per frame, see @poly
+    float m_poly_min_salience = 0.02f;   // See @polymin
+    bool m_poly_warned = false;          // Reported that the model has no activations
+    bool m_send_frames = true;     // Send frames to the float outlets
+    bool m_batch_enabled;       // Share batched inference with matching instances
+    std::atomic<int> m_hop_request; // Requested hop size (0 for chunk size), read by the loader
+    int m_hop_size;             // Effective hop size, a divisor of the chunk size
+    size_t m_hop_phase;         // Stream that receives the next window
+    bool m_batch_warned;        // Flag for reporting an unbatchable model once
     symbol m_model_path;        // Path to model specified by argument
     number m_target_chunk;      // Target chunk size for model initialization
+    fs::path m_package_directory;                  // Looked up in the constructor, empty if not found
+    std::vector<std::string> m_models_directories; // Looked up in the constructor
+    TuningProfile m_profile;    // This machine's tuning profile when the object was created
+    bool m_rate_known = false;  // dspsetup has reported the host sample rate
+    number m_requested_samplerate = 0.0; // Host sample rate of the latest load request
     float m_saved_phase = 0.0f; // Keep track of phase for frequency tests
+    int m_warmup_passes = 0;    // Warm-up passes run on the current model
+    double m_cold_latency_ms = 0.0; // First forward of the current model
+    double m_warm_latency_ms = 0.0; // Last warm-up forward of the current model
     bool m_error_reported = false; // Flag for error reporting
     int m_audio_frames_without_model = 0; // Counter for audio frames processed without model
+    bool m_overrun_reported = false; // Flag for reporting dropped audio
     
     // Threading and buffer components
     CircularBuffer m_in_buffer; // Circular buffer for audio input
-    std::unique_ptr<float[]> m_model_input_buffer; // Pre-allocated buffer for model input
-    torch::TensorOptions m_tensor_options; // Pre-created tensor options
     
     // Threading synchronization
-    std::binary_semaphore m_data_ready, m_result_ready;
+    std::counting_semaphore<> m_wake;          // Released once per wakeup of the inference thread
+    std::atomic<bool> m_wake_pending { false }; // A release hasn't been picked up yet
     std::unique_ptr<std::thread> m_inference_thread;
     std::atomic<bool> m_should_stop;
     std::mutex m_model_mutex; // Protect model access
     
-    torch::jit::script::Module m_module;
-    bool m_model_loaded;
+    std::shared_ptr<const ModelCache::Entry> m_model; // Shared weights, kept alive while in use
+    std::string m_model_name;                          // Filename of the current model
+    std::vector<ChannelSession> m_sessions;            // Per-instance streaming state, one per hop phase
+    ModelSession m_test_session;                       // Separate state for test messages
+    std::vector<PitchResult> m_results;                // Latest inference result per channel
+    atoms m_output_lists[3];                           // Preallocated list outputs for several channels
+    bool m_split_reported = false;                     // Flag for reporting an unbatchable model once
+    
+    static constexpr int k_max_channels = 64;
+    int m_channels;                                    // Number of input channels
+    bool m_gated[k_max_channels] = {};                 // Channels below @gate in the current chunk
+    std::vector<std::unique_ptr<inlet<>>> m_channel_inputs; // Signal inlets after the first
+    
+    // Thresholded results of one chunk, passed from the inference thread to the scheduler
+    struct ResultRecord {
+        std::array<PitchResult, k_max_channels> channels;
+        uint64_t timestamp;   // Host sample of the first sample of the window
+        int poly;             // @poly when the frame was analysed, 0 for no candidate messages
+        uint8_t candidate_counts[k_max_channels];
+        PitchCandidates::Candidate candidates[k_max_channels][PitchCandidates::k_max_candidates];
+    };
+    static constexpr size_t k_max_result_burst = 8;    // Older results are coalesced beyond this
+    SpscQueue<ResultRecord, 32> m_result_queue;        // Inference thread to scheduler
+    struct NoteRecord {
+        PitchTracker::NoteEvent event;
+        int channel;
+        uint64_t timestamp;   // Window of the frame that completed the event
+    };
+    static constexpr size_t k_note_queue_capacity = 256;
+    SpscQueue<NoteRecord, k_note_queue_capacity> m_note_queue; // Room is kept for note-offs, see queue_notes
+    bool m_segmenting = false;                         // @notes at the last frame (inference thread)
+    std::vector<PitchTracker> m_trackers;              // Smoothing and segmentation state per channel
+    std::vector<PitchCandidates> m_candidate_pickers;  // Polyphonic candidates per channel, see @poly
+    int m_frame_poly = 0;                              // @poly of the current frame
+    uint8_t m_candidate_counts[k_max_channels] = {};   // Candidates of the current frame per channel
+    PitchCandidates::Candidate m_candidates[k_max_channels][PitchCandidates::k_max_candidates];
+    std::atomic<bool> m_results_scheduled { false };   // The delivery timer is armed
+    
+    // A result scheduled for the signal outlets at a position in the input stream
+    struct SignalEvent {
+        float values[3];   // Thresholded pitch, confidence, amplitude
+        size_t position;   // Ring position at which the result takes effect
+        uint32_t epoch;    // Ring epoch the position belongs to
+    };
+    SpscQueue<SignalEvent, 256> m_signal_events; // Inference thread to audio thread
+    float m_signal_values[3] = {0.0f, 0.0f, 0.0f};
+    float m_signal_steps[3] = {0.0f, 0.0f, 0.0f};
+    size_t m_signal_ramp = 0;                    // Samples left in the current ramp
+    std::atomic<bool> m_model_loaded;
+    std::unique_ptr<BatchGroup::Member> m_batch_member; // Membership of the shared batch, owned by the inference thread
+    bool m_batch_served = false; // The shared batch ran the last chunk, not the session
+    
+    std::unique_ptr<std::thread> m_loader_thread;
+    std::mutex m_loader_mutex;                             // Guards the loader state below
+    std::condition_variable m_loader_wake;
+    std::optional<LoadRequest> m_load_request;             // Latest request wins
+    std::unique_ptr<PendingModel> m_pending_model;         // Ready to be swapped in
+    std::vector<std::unique_ptr<PendingModel>> m_retired;  // Swapped out, released on the loader thread
+    bool m_loader_stop = false;
+    std::atomic<bool> m_swap_pending { false };
+    std::atomic<bool> m_reset_requested { false }; // bang, applied before the next window
+    
+    // @auto chunk adaptation, measured on the inference thread
+    static constexpr double k_auto_high = 0.6;         // Step up above this share of the hop's duration
+    static constexpr double k_auto_low = 0.15;         // Step down below it
+    static constexpr double k_auto_period_s = 2.0;     // Audio analysed per evaluation
+    static constexpr int k_auto_headroom_periods = 3;  // Periods below k_auto_low before stepping down
+    static constexpr double k_auto_late_share = 0.02;  // Share of results later than a hop that counts as slipping
+    std::atomic<bool> m_auto_enabled { false };
+    std::atomic<int> m_auto_limit { 0 };               // Step the loader had no model for, until the next swap
+    double m_auto_load = -1.0;                         // Smoothed forward time over hop duration, < 0 before the first
+    double m_auto_elapsed = 0.0;                       // Seconds of audio in the current period
+    int m_auto_low_periods = 0;
+    bool m_auto_step_pending = false;                  // Waiting for the loader to swap or give up
+    uint64_t m_auto_overruns = 0;                      // Ring overruns at the start of the period
+    int m_auto_frames = 0;                             // Results in the current period
+    int m_auto_late = 0;                               // Of which arrived more than a hop after their window
+    
+    // Inference thread scheduling, applied by the inference thread itself
+    std::atomic<int> m_intra_threads { 0 };
+    std::atomic<int> m_interop_threads { 0 };
+    std::atomic<uint64_t> m_affinity_mask { 0 };
+    std::atomic<bool> m_thread_settings_changed { false };
+    
+    // Runtime statistics, updated on the audio and inference threads without locks
+    LatencyHistogram m_inference_latency;            // Forward time per chunk
+    LatencyHistogram m_output_delay;                 // End of a chunk's audio to its result
+    std::atomic<uint64_t> m_stat_inferences { 0 };
+    std::atomic<uint64_t> m_stat_busy { 0 };         // Vectors where inference was still busy
+    std::atomic<uint64_t> m_stat_errors { 0 };
+    std::atomic<uint64_t> m_stat_coalesced { 0 };    // Results skipped while the scheduler fell behind
+    std::atomic<uint64_t> m_stat_gated { 0 };        // Chunks below @gate that skipped inference
+    std::atomic<float> m_input_rms { 0.0f };         // Level of the first channel's last chunk
+    std::atomic<float> m_input_peak { 0.0f };
+    std::atomic<size_t> m_stat_queue_max { 0 };      // Largest backlog seen at a chunk
+    std::atomic<size_t> m_last_put_position { 0 };   // Ring position after the last vector
+    std::atomic<int64_t> m_last_put_time { 0 };      // steady_clock time of the last vector
+    
+    // Ring and host sample counts at the end of the last vector, published by the audio
+    // thread under a sequence counter so the inference thread reads them as a pair
+    std::atomic<uint32_t> m_put_sequence { 0 };      // Odd while the audio thread updates the pair
+    std::atomic<uint64_t> m_put_stream_position { 0 }; // CircularBuffer::stream_position after the vector
+    std::atomic<uint64_t> m_put_host_position { 0 };   // Host samples seen after the vector
+    uint64_t m_host_samples = 0;                     // Host samples seen by the audio thread
+    uint64_t m_window_timestamp = 0;                 // Host sample of the window being analysed (inference thread)
+    uint64_t m_stats_base_overruns = 0;
+    uint64_t m_stats_base_underruns = 0;
+    
+    // An offline analysis, written by the analyze thread until it is delivered
+    struct Analysis {
+        symbol source;
+        symbol targets[3] = { symbol(""), symbol(""), symbol("") }; // Pitch, confidence, amplitude buffers
+        double period_ms = 0.0;                                      // Time between results
+        std::vector<PitchResult> results;
+    };
+    Analysis m_analysis;
+    std::unique_ptr<std::thread> m_analyze_thread;
+    std::atomic<bool> m_analyze_running { false };
+    std::atomic<bool> m_analyze_cancel { false };
+    
+    std::unique_ptr<std::thread> m_bench_thread;
+    std::atomic<bool> m_bench_running { false };
+    std::atomic<bool> m_bench_cancel { false };
+    
+    std::mutex m_info_mutex;
+    std::vector<atoms> m_info_messages; // Notifications waiting for the main thread
+    
+    // Audio thread handshake for swaps that have to resize the ring or resamplers
+    static constexpr int k_hold_requested = 1;
+    static constexpr int k_hold_acknowledged = 2;
+    std::atomic<int> m_audio_hold { 0 };
     
     // Clear the audio buffer
     void clear_buffer() {
         m_in_buffer.clear();
     }
     
-    // Feed zeros to reset the model's internal state
-    void feed_zeros_to_model() {
-        if (!m_model_loaded) return;
+    // Return every stream to its settled state (inference thread, model mutex held)
+    void reset_sessions() {
+        for (auto& session : m_sessions) {
+            session.reset();
+        }
+        if (m_batch_member) m_batch_member->reset();
+        m_hop_phase = 0;
+    }
+    
+    // Load the model the analysis of a buffer~ at this rate runs when none is loaded yet,
+    // e.g. before DSP has started (analysis thread)
+    bool load_analysis_model(double samplerate, int target_chunk, std::shared_ptr<const ModelCache::Entry>& model,
+                             int& chunk_size, double& model_samplerate) {
+        auto models = target_chunk > 0 ? find_compatible_models(false, target_chunk, samplerate) : std::vector<ModelIndex::ModelFile>();
+        if (models.empty()) models = find_compatible_models(false, 0, samplerate);
+        if (models.empty()) return false;
+        const auto& file = models.front();
+        model = ModelCache::acquire(file.path, optimize, resolve_device(), ModelIndex::precision_dtype(file.precision), mmap_weights);
+        chunk_size = file.chunk_size;
+        model_samplerate = ModelIndex::rate_from_tag(file.rate_tag);
+        cout << "Analyzing with " << file.filename << endl;
+        return true;
+    }
+    
+    // Convert a whole recording to another sample rate
+    static std::vector<float> resample_offline(const std::vector<float>& audio, double in_rate, double out_rate) {
+        PolyphaseResampler resampler;
+        resampler.configure(in_rate, out_rate);
+        std::vector<float> block(resampler.max_output(PolyphaseResampler::k_max_block));
+        std::vector<float> converted;
+        converted.reserve(static_cast<size_t>(audio.size() * out_rate / in_rate) + block.size());
+        
+        // Flush the filter's group delay with silence and drop it from the start
+        size_t delay = static_cast<size_t>(std::lround(resampler.group_delay() * out_rate / in_rate));
+        std::vector<float> padded(audio);
+        padded.resize(audio.size() + static_cast<size_t>(std::ceil(resampler.group_delay())) + 1, 0.0f);
+        for (size_t offset = 0; offset < padded.size(); offset += PolyphaseResampler::k_max_block) {
+            size_t count = std::min(padded.size() - offset, PolyphaseResampler::k_max_block);
+            size_t produced = resampler.process(padded.data() + offset, count, block.data());
+            converted.insert(converted.end(), block.begin(), block.begin() + produced);
+        }
+        converted.erase(converted.begin(), converted.begin() + std::min(delay, converted.size()));
+        converted.resize(std::min(converted.size(), static_cast<size_t>(std::ceil(audio.size() * out_rate / in_rate))));
+        return converted;
+    }
+    
+    // Apply the thresholds and write the results to the target buffers or a dict (main thread)
+    void write_analysis() {
+        auto& results = m_analysis.results;
+        for (auto& result : results) {
+            if ((m_confidence_threshold > 0.0 && result.confidence < m_confidence_threshold) ||
+                (m_amplitude_threshold > 0.0 && result.amplitude < m_amplitude_threshold)) {
+                result.pitch = -1500.0f;
+            }
+        }
+        
+        if (m_analysis.targets[0] != symbol("")) {
+            for (int k = 0; k < 3; ++k) {
+                m_analyze_targets[k].set(m_analysis.targets[k]);
+                buffer_lock<false> target(m_analyze_targets[k]);
+                if (!target.valid()) {
+                    cout << "Cannot write analysis: buffer~ " << std::string(m_analysis.targets[k]) << " not found" << endl;
+                    continue;
+                }
+                target.resize_in_samples(results.size());
+                for (size_t i = 0; i < results.size() && i < target.frame_count(); ++i) {
+                    const PitchResult& result = results[i];
+                    target.lookup(i, 0) = k == 0 ? result.pitch : k == 1 ? result.confidence : result.amplitude;
+                }
+                target.dirty();
+            }
+            return;
+        }
+        
+        dict output { symbol(std::string(m_analysis.source) + ".pesto") };
+        atoms times, pitches, confidences, amplitudes;
+        times.reserve(results.size());
+        pitches.reserve(results.size());
+        confidences.reserve(results.size());
+        amplitudes.reserve(results.size());
+        for (size_t i = 0; i < results.size(); ++i) {
+            times.push_back(i * m_analysis.period_ms);
+            pitches.push_back(results[i].pitch);
+            confidences.push_back(results[i].confidence);
+            amplitudes.push_back(results[i].amplitude);
+        }
+        output.clear();
+        output["time"] = times;
+        output["pitch"] = pitches;
+        output["confidence"] = confidences;
+        output["amplitude"] = amplitudes;
+        output.touch();
+    }
+    
+    // Run report_accuracy on the bench thread, since it may load the fp32 model and runs
+    // both over a sweep. A running benchmark compares precisions itself (main thread).
+    void start_accuracy_report() {
+        if (m_bench_running) return;
+        if (m_bench_thread && m_bench_thread->joinable()) m_bench_thread->join();
+        m_bench_running = true;
+        m_bench_thread = std::make_unique<std::thread>([this]() {
+            torch::NoGradGuard no_grad;
+            report_accuracy();
+            m_bench_running = false;
+        });
+    }
+    
+    // Report how far a reduced precision model is from its fp32 variant (bench thread)
+    void report_accuracy() {
+        std::shared_ptr<const ModelCache::Entry> model;
+        std::string name;
+        int chunk_size;
+        double samplerate;
+        {
+            std::lock_guard<std::mutex> lock(m_model_mutex);
+            model = m_model;
+            name = m_model_name;
+            chunk_size = n_chunk_size;
+            samplerate = m_model_samplerate;
+        }
+        std::string precision = ModelIndex::parse(name).precision;
+        if (!model || precision == "fp32") return;
         
         try {
-            std::vector<float> zeros(n_chunk_size, 0.0f);
-            auto options = torch::TensorOptions().dtype(torch::kFloat32);
-            
-            // Feed zeros multiple times to clear any internal state
-            for (int i = 0; i < 8; i++) {
-                torch::Tensor zero_tensor = torch::from_blob(zeros.data(), {1, (int)n_chunk_size}, options).clone();
-                std::vector<torch::jit::IValue> inputs;
-                inputs.push_back(zero_tensor);
+            for (const auto& candidate : find_compatible_models(true, chunk_size)) {
+                if (m_bench_cancel) return;
+                if (candidate.precision != "fp32") continue;
+                auto reference = ModelCache::acquire(candidate.path, optimize, model->device(), torch::kFloat32, mmap_weights);
+                AccuracyDelta delta = Benchmark::compare(*model, *reference, chunk_size, samplerate);
+                cout << "Accuracy of " << name << " (" << precision << " against " << candidate.filename << "): mean pitch error " << delta.mean_pitch
+                     << " semitones, max " << delta.max_pitch << ", mean confidence error " << delta.mean_confidence << endl;
+                post_info({ symbol("test"), symbol("accuracy"), delta.mean_pitch, delta.max_pitch, delta.mean_confidence });
+                return;
+            }
+        }
+        catch (const std::exception& e) {
+            cout << "Could not compare " << name << " against fp32: " << e.what() << endl;
+            return;
+        }
+        cout << "No fp32 model with chunk size " << chunk_size << " to compare " << name << " against" << endl;
+    }
+    
+    // Benchmark every compatible model and report the results (bench thread)
+    void run_bench(int iterations, const fs::path& json_file, const fs::path& profile_file) {
+        torch::NoGradGuard no_grad;
+        int intra_threads = m_intra_threads.load();
+        if (intra_threads > 0) at::set_num_threads(intra_threads);
+        int cores = std::max<int>(std::thread::hardware_concurrency(), 1);
+        
+        std::vector<BenchReport> report;
+        auto models = find_compatible_models(true);
+        for (const auto& file : models) {
+            if (m_bench_cancel) return;
+            const std::string& filename = file.filename;
+            const std::string& precision = file.precision;
+            int chunk_size = file.chunk_size;
+            double samplerate = ModelIndex::rate_from_tag(file.rate_tag);
+            BenchReport entry { filename };
+            auto& results = entry.runs;
+            try {
+                auto model = ModelCache::acquire(file.path, optimize, resolve_device(), ModelIndex::precision_dtype(precision), mmap_weights);
+                Benchmark benchmark(model, chunk_size, samplerate, intra_threads, m_bench_cancel);
+                for (int batch : { 1, 2, 4, 8 }) {
+                    results.push_back(benchmark.batched(batch, iterations));
+                }
+                for (int count : { 2, 4 }) {
+                    if (count <= cores) results.push_back(benchmark.instances(count, iterations));
+                }
                 
+                // Compare reduced precision variants against the fp32 model of the same chunk size
+                auto reference = std::find_if(models.begin(), models.end(), [&](const auto& other) {
+                    return other.chunk_size == chunk_size && other.precision == "fp32";
+                });
+                if (precision != "fp32" && reference != models.end()) {
+                    auto reference_model = ModelCache::acquire(reference->path, optimize, resolve_device(), torch::kFloat32, mmap_weights);
+                    entry.accuracy = Benchmark::compare(*model, *reference_model, chunk_size, samplerate);
+                }
+            }
+            catch (const std::exception& e) {
+                cout << "Bench: could not load " << filename << ": " << e.what() << endl;
+                continue;
+            }
+            
+            if (entry.accuracy.valid) {
+                cout << "Bench " << filename << " accuracy against fp32: mean pitch error " << entry.accuracy.mean_pitch
+                     << " semitones, max " << entry.accuracy.max_pitch << ", mean confidence error " << entry.accuracy.mean_confidence << endl;
+                post_info({ symbol("bench"), symbol(filename), symbol("accuracy"), entry.accuracy.mean_pitch,
+                            entry.accuracy.max_pitch, entry.accuracy.mean_confidence });
+            }
+            for (const auto& result : results) {
+                if (!result.error.empty()) {
+                    cout << "Bench " << filename << " " << result.mode << " " << result.size << ": " << result.error << endl;
+                    continue;
+                }
+                cout << "Bench " << filename << " " << result.mode << " " << result.size
+                     << ": min " << result.min_ms << " ms, median " << result.median_ms << " ms, p99 " << result.p99_ms
+                     << " ms, max " << result.max_ms << " ms, " << result.chunks_per_second << " chunks/s, RTF " << result.realtime_factor << endl;
+                post_info({ symbol("bench"), symbol(filename), symbol(result.mode), result.size, result.min_ms, result.median_ms,
+                            result.p99_ms, result.max_ms, result.chunks_per_second, result.realtime_factor });
+            }
+            report.push_back(std::move(entry));
+        }
+        
+        if (!json_file.empty()) {
+            if (write_bench_json(json_file, iterations, intra_threads, report)) {
+                cout << "Bench results written to " << json_file.string() << endl;
+            }
+        }
+        if (!m_bench_cancel) update_profile(models, report, iterations, profile_file);
+        post_info({ symbol("bench"), symbol("done") });
+    }
+    
+    // Choose this machine's profile from a bench report, tune the intra-op thread count
+    // for it and store it in the given file for new instances (bench thread). More threads
+    // have to cut the p99 by a tenth to be worth taking cores from other instances.
+    void update_profile(const std::vector<ModelIndex::ModelFile>& models, const std::vector<BenchReport>& report, int iterations,
+                        const fs::path& path) {
+        TuningProfile tuned = TuningProfile::choose(report);
+        auto file = std::find_if(models.begin(), models.end(), [&](const auto& model) { return model.filename == tuned.model; });
+        if (!tuned.valid() || file == models.end()) {
+            cout << "Bench: no model keeps up within " << 100.0 * TuningProfile::k_headroom
+                 << "% of its chunk duration, tuning profile left unchanged" << endl;
+            return;
+        }
+        
+        torch::Device target = resolve_device();
+        tuned.device = target.type() == torch::kCUDA ? "cuda" : target.type() == torch::kMPS ? "mps" : "cpu";
+        tuned.optimize = optimize;
+        int cores = std::max<int>(std::thread::hardware_concurrency(), 1);
+        int previous_threads = at::get_num_threads();
+        try {
+            auto model = ModelCache::acquire(file->path, optimize, target, ModelIndex::precision_dtype(file->precision), mmap_weights);
+            std::vector<int> counts;
+            for (int count = 1; count < cores; count *= 2) counts.push_back(count);
+            counts.push_back(cores);
+            
+            double best_p99 = 0.0;
+            for (int count : counts) {
+                if (m_bench_cancel) break;
+                at::set_num_threads(count);
+                Benchmark benchmark(model, file->chunk_size, ModelIndex::rate_from_tag(file->rate_tag), count, m_bench_cancel);
+                BenchResult result = benchmark.batched(1, iterations);
+                if (!result.error.empty()) continue;
+                cout << "Bench " << file->filename << " threads " << count << ": p99 " << result.p99_ms << " ms" << endl;
+                if (best_p99 == 0.0 || result.p99_ms < 0.9 * best_p99) {
+                    best_p99 = result.p99_ms;
+                    tuned.threads = count;
+                }
+            }
+            if (best_p99 > 0.0) tuned.p99_ms = best_p99;
+        }
+        catch (const std::exception& e) {
+            cout << "Bench: could not tune threads for " << file->filename << ": " << e.what() << endl;
+        }
+        at::set_num_threads(previous_threads);
+        if (m_bench_cancel) return;
+        
+        std::string error;
+        if (path.empty() || !tuned.write(path, error)) {
+            cout << "Could not store the tuning profile" << (error.empty() ? "" : ", " + error) << endl;
+            return;
+        }
+        cout << "Tuning profile written to " << path.string() << ": chunk " << tuned.chunk_size << ", " << tuned.precision
+             << ", " << tuned.device << ", " << tuned.threads << " threads, p99 " << tuned.p99_ms << " ms of " << tuned.budget_ms << " ms" << endl;
+        post_info({ symbol("bench"), symbol("profile"), tuned.chunk_size, symbol(tuned.precision), symbol(tuned.device), tuned.threads });
+    }
+    
+    bool write_bench_json(const fs::path& file, int iterations, int intra_threads,
+                          const std::vector<BenchReport>& report) {
+        std::ofstream out(file);
+        if (!out) {
+            cout << "Could not write bench results to " << file.string() << endl;
+            return false;
+        }
+        out << "{\n  \"iterations\": " << iterations << ",\n  \"threads\": " << intra_threads
+            << ",\n  \"cores\": " << std::thread::hardware_concurrency() << ",\n  \"models\": [";
+        for (size_t m = 0; m < report.size(); ++m) {
+            out << (m ? "," : "") << "\n    { \"model\": " << json_quoted(report[m].model);
+            if (report[m].accuracy.valid) {
+                const auto& accuracy = report[m].accuracy;
+                out << ", \"accuracy\": { \"mean_pitch_error\": " << accuracy.mean_pitch << ", \"max_pitch_error\": " << accuracy.max_pitch
+                    << ", \"mean_confidence_error\": " << accuracy.mean_confidence << " }";
+            }
+            out << ", \"runs\": [";
+            const auto& results = report[m].runs;
+            for (size_t r = 0; r < results.size(); ++r) {
+                const auto& result = results[r];
+                out << (r ? "," : "") << "\n      { \"mode\": " << json_quoted(result.mode) << ", \"size\": " << result.size;
+                if (!result.error.empty()) {
+                    out << ", \"error\": " << json_quoted(result.error) << " }";
+                    continue;
+                }
+                out << ", \"min_ms\": " << result.min_ms << ", \"median_ms\": " << result.median_ms
+                    << ", \"p99_ms\": " << result.p99_ms << ", \"max_ms\": " << result.max_ms
+                    << ", \"chunks_per_second\": " << result.chunks_per_second
+                    << ", \"realtime_factor\": " << result.realtime_factor << " }";
+            }
+            out << "\n    ] }";
+        }
+        out << "\n  ]\n}\n";
+        return static_cast<bool>(out);
+    }
+    
+    // Run silence through a new session so TorchScript's profiling passes and its
+    // streaming state settle before use. Returns the first and last pass times in ms.
+    std::pair<double, double> warm_up(ChannelSession& session, int chunk_size, int passes) {
+        std::vector<PitchResult> results(m_channels);
+        double first_ms = 0.0, last_ms = 0.0;
+        for (int i = 0; i < passes; i++) {
+            for (int channel = 0; channel < m_channels; ++channel) {
+                std::fill_n(session.input(channel), chunk_size, 0.0f);
+            }
+            auto start_time = std::chrono::high_resolution_clock::now();
+            session.run(results.data());
+            auto end_time = std::chrono::high_resolution_clock::now();
+            last_ms = std::chrono::duration<double, std::milli>(end_time - start_time).count();
+            if (i == 0) first_ms = last_ms;
+        }
+        return { first_ms, last_ms };
+    }
+    
+    // Queue a notification for the info outlet (any thread)
+    void post_info(atoms message) {
+        {
+            std::lock_guard<std::mutex> lock(m_info_mutex);
+            m_info_messages.push_back(std::move(message));
+        }
+        deliver_info.set();
+    }
+    
+    // Serve load requests and release swapped out models, off the audio and main threads
+    void run_loader() {
+        torch::NoGradGuard no_grad;
+        
+        while (true) {
+            LoadRequest request;
+            std::vector<std::unique_ptr<PendingModel>> retired;
+            {
+                std::unique_lock<std::mutex> lock(m_loader_mutex);
+                m_loader_wake.wait(lock, [this] { return m_loader_stop || m_load_request || !m_retired.empty(); });
+                if (m_loader_stop) return;
+                retired.swap(m_retired);
+                if (!m_load_request) continue;
+                request = *m_load_request;
+                m_load_request.reset();
+            }
+            retired.clear();
+            
+            auto prepared = std::make_unique<PendingModel>();
+            bool loaded = false;
+            
+            if (request.rehop) {
+                std::string name;
                 {
                     std::lock_guard<std::mutex> lock(m_model_mutex);
-                    m_module.forward(inputs);
+                    name = m_model_name;
+                }
+                if (name.empty()) continue;
+                loaded = prepare_model(name, *prepared);
+                if (!loaded) continue; // The current model and hop keep running
+                cout << "Hop size = " << prepared->hop_size << " (" << prepared->sessions.size() << " overlapping streams)" << endl;
+            }
+            // Adapting to the load, silently keep the current model at either end of the range
+            else if (request.step != 0) {
+                auto neighbour = adjacent_model(request.target_chunk, request.step);
+                if (!neighbour) {
+                    m_auto_limit.store(request.step);
+                    continue;
+                }
+                cout << "Adapting to the load, chunk size " << request.target_chunk << " -> " << neighbour->chunk_size << endl;
+                loaded = prepare_model(neighbour->filename, *prepared);
+            }
+            // If a specific model path was provided, load it
+            else if (request.model_path != symbol("")) {
+                std::string model_file_str = request.model_path;
+                cout << "Loading specified model: " << model_file_str << endl;
+                loaded = prepare_model(model_file_str, *prepared);
+                
+                // If loading fails, fall back to best matching model
+                if (!loaded) {
+                    cout << "Failed to load specified model, falling back to best match" << endl;
                 }
             }
+            // Otherwise, or on failure, find the best matching model based on chunk size preference
+            if (!loaded && request.step == 0 && !request.rehop) {
+                loaded = prepare_best_model(request.target_chunk, *prepared);
+            }
+            
+            if (!loaded) {
+                if (request.step != 0) m_auto_limit.store(request.step);
+                else post_info({ symbol("error"), symbol("no model could be loaded") });
+                continue;
+            }
+            
+            // Hand over to the inference thread, replacing any model it hasn't picked up yet
+            {
+                std::lock_guard<std::mutex> lock(m_loader_mutex);
+                if (m_pending_model) m_retired.push_back(std::move(m_pending_model));
+                m_pending_model = std::move(prepared);
+            }
+            m_swap_pending.store(true, std::memory_order_release);
+            wake_inference();
         }
-        catch (const c10::Error& e) {
-            cout << "Error feeding zeros to model: " << e.what() << endl;
+    }
+    
+    // Wake the inference thread unless a wakeup is already pending. Returns false when
+    // one was, the thread then picks up whatever is new when it gets to it.
+    bool wake_inference() {
+        if (m_wake_pending.exchange(true, std::memory_order_seq_cst)) return false;
+        m_wake.release();
+        return true;
+    }
+    
+    // Swap in the model prepared by the loader (inference thread, between chunks). The
+    // ring and resamplers are only touched, with the audio thread held off, when the new
+    // model needs a larger ring or a different sample rate. If the audio thread doesn't
+    // acknowledge the hold, the model stays pending and the swap is retried at the next
+    // wakeup.
+    void apply_pending_model() {
+        std::unique_ptr<PendingModel> pending;
+        {
+            std::lock_guard<std::mutex> lock(m_loader_mutex);
+            pending = std::move(m_pending_model);
+            m_swap_pending.store(false, std::memory_order_relaxed);
+        }
+        if (!pending) return;
+        
+        size_t buffer_size = power_ceil(std::max(4 * pending->chunk_size, 4096));
+        bool grow = buffer_size > m_in_buffer.size();
+        bool rate_change = pending->samplerate != m_model_samplerate;
+        bool hold = m_model_loaded && (grow || rate_change);
+        
+        if (hold && !hold_audio()) {
+            std::lock_guard<std::mutex> lock(m_loader_mutex);
+            if (m_pending_model) {
+                m_retired.push_back(std::move(pending)); // A newer model arrived meanwhile
+            } else {
+                m_pending_model = std::move(pending);
+            }
+            m_swap_pending.store(true, std::memory_order_release);
+            return;
+        }
+        if (grow) {
+            m_in_buffer.resize(buffer_size, m_channels);
+            m_in_buffer.clear();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_model_mutex);
+            std::swap(m_sessions, pending->sessions);
+            std::swap(m_test_session, pending->test_session);
+            std::swap(m_model, pending->model);
+            m_model_name = pending->name;
+            n_chunk_size = pending->chunk_size;
+            m_model_samplerate = pending->samplerate;
+            m_hop_size = pending->hop_size;
+            m_hop_phase = 0;
+            m_warmup_passes = pending->warmup_passes;
+            m_cold_latency_ms = pending->cold_latency_ms;
+            m_warm_latency_ms = pending->warm_latency_ms;
+            for (auto& picker : m_candidate_pickers) picker.reset();
+            m_poly_warned = false;
+            if (rate_change || !m_model_loaded) configure_resampler();
+        }
+        if (hold) m_audio_hold.store(0, std::memory_order_release);
+        
+        m_overrun_reported = false;
+        m_model_loaded = true;
+        restart_adaptation();
+        if (priority == ThreadControl::Priority::realtime) {
+            m_thread_settings_changed = true; // The real-time period follows the chunk size
+        }
+        post_info({ symbol("ready"), symbol(pending->name), n_chunk_size });
+        
+        // Release the old model's sessions on the loader thread
+        {
+            std::lock_guard<std::mutex> lock(m_loader_mutex);
+            m_retired.push_back(std::move(pending));
+        }
+        m_loader_wake.notify_one();
+    }
+    
+    // Wait until the audio thread has acknowledged that it keeps off the ring. Without
+    // DSP running there is no audio callback to wait for. Returns false, with the hold
+    // withdrawn, when the audio thread didn't acknowledge it in time.
+    bool hold_audio() {
+        m_audio_hold.store(k_hold_requested, std::memory_order_release);
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(500);
+        while (m_dsp_active && m_audio_hold.load(std::memory_order_acquire) != k_hold_acknowledged) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                // Fails when the acknowledgement came in after all
+                int expected = k_hold_requested;
+                return !m_audio_hold.compare_exchange_strong(expected, 0, std::memory_order_acq_rel);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return true;
+    }
+    
+    // Keep the signal outlets at their current values (audio thread)
+    void hold_signal_outputs(audio_bundle& output, size_t frames) {
+        if (signal_mode == signal_modes::off) {
+            clear_signal_outputs(output, frames);
+            return;
+        }
+        for (int k = 0; k < 3; ++k) {
+            std::fill_n(output.samples(k), frames, m_signal_values[k]);
+        }
+    }
+    
+    void clear_signal_outputs(audio_bundle& output, size_t frames) {
+        for (size_t channel = 0; channel < output.channel_count(); ++channel) {
+            std::fill_n(output.samples(channel), frames, 0.0);
+        }
+    }
+    
+    // Write the signal outlets for the vector that starts at a ring position, applying
+    // each queued result at its sample offset (audio thread). Ring positions are at the
+    // model's sample rate, so host samples are mapped through the resampling ratio.
+    void write_signal_outputs(audio_bundle& output, size_t vector_start, size_t frames) {
+        signal_modes mode = signal_mode;
+        if (mode == signal_modes::off) {
+            while (m_signal_events.pop()) {}
+            clear_signal_outputs(output, frames);
+            return;
+        }
+        
+        double* outs[3] = { output.samples(0), output.samples(1), output.samples(2) };
+        uint32_t epoch = m_in_buffer.epoch();
+        
+        for (size_t i = 0; i < frames; ++i) {
+            // Apply results due at this sample, results arriving late are applied at once
+            size_t position = vector_start + static_cast<size_t>(i * m_resample_ratio);
+            while (const SignalEvent* event = m_signal_events.front()) {
+                if (event->epoch == epoch && (ptrdiff_t)(event->position - position) > 0) break;
+                if (event->epoch == epoch) start_signal_segment(*event, mode);
+                m_signal_events.pop();
+            }
+            
+            for (int k = 0; k < 3; ++k) {
+                if (m_signal_ramp > 0) m_signal_values[k] += m_signal_steps[k];
+                outs[k][i] = m_signal_values[k];
+            }
+            if (m_signal_ramp > 0) --m_signal_ramp;
+        }
+    }
+    
+    void start_signal_segment(const SignalEvent& event, signal_modes mode) {
+        size_t ramp = mode == signal_modes::linear ? std::max(m_hop_size, 1) : 0;
+        for (int k = 0; k < 3; ++k) {
+            // Never glide into or out of the low confidence pitch sentinel
+            bool sentinel = k == 0 && (event.values[0] <= -1500.0f || m_signal_values[0] <= -1500.0f);
+            if (ramp > 0 && !sentinel) {
+                m_signal_steps[k] = (event.values[k] - m_signal_values[k]) / ramp;
+            } else {
+                m_signal_values[k] = event.values[k];
+                m_signal_steps[k] = 0.0f;
+            }
+        }
+        m_signal_ramp = ramp;
+    }
+    
+    // Apply the thread attributes to the calling inference thread. The intra-op count is
+    // set from here because OpenMP keeps it per thread.
+    void apply_thread_settings() {
+        std::string error;
+        if (int count = m_intra_threads.load()) {
+            at::set_num_threads(count);
+        }
+        if (!ThreadControl::set_interop_threads(m_interop_threads.load(), error)) {
+            cout << "Could not set inter-op threads, " << error << endl;
+        }
+        if (!ThreadControl::set_affinity(m_affinity_mask.load(), error)) {
+            cout << "Could not set inference thread affinity, " << error << endl;
+        }
+        double period = n_chunk_size / m_model_samplerate;
+        if (!ThreadControl::set_priority(priority, period, error)) {
+            cout << "Could not set inference thread priority, " << error << endl;
+        }
+    }
+    
+    // Time in us from when the sample at a ring position reached the object until now,
+    // estimated from the most recent vector written by the audio thread. Both values are
+    // read separately, so the estimate may be off by one vector.
+    double output_delay(size_t position, std::chrono::steady_clock::time_point now) {
+        size_t put_position = m_last_put_position.load(std::memory_order_relaxed);
+        std::chrono::steady_clock::time_point put_time { std::chrono::steady_clock::duration(m_last_put_time.load(std::memory_order_relaxed)) };
+        double behind = 1e6 * static_cast<ptrdiff_t>(put_position - position) / m_model_samplerate;
+        return std::chrono::duration<double, std::micro>(now - put_time).count() + behind;
+    }
+    
+    // Audio thread: publish where the ring and the host stream are after a vector
+    void publish_put_stamp(uint64_t stream_position) {
+        uint32_t sequence = m_put_sequence.load(std::memory_order_relaxed);
+        m_put_sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_put_stream_position.store(stream_position, std::memory_order_relaxed);
+        m_put_host_position.store(m_host_samples, std::memory_order_relaxed);
+        m_put_sequence.store(sequence + 2, std::memory_order_release);
+    }
+    
+    // Host sample at which the audio at a ring position entered the object (inference
+    // thread, model mutex held). Counted back from the latest vector, which the window
+    // is part of, at the host to model rate ratio and less the resampler's delay.
+    uint64_t host_timestamp(size_t position) {
+        uint32_t before, after;
+        uint64_t put_stream, put_host;
+        do {
+            before = m_put_sequence.load(std::memory_order_acquire);
+            put_stream = m_put_stream_position.load(std::memory_order_relaxed);
+            put_host = m_put_host_position.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = m_put_sequence.load(std::memory_order_relaxed);
+        } while (before != after || (before & 1));
+        
+        double ratio = m_resampling ? 1.0 / m_resample_ratio : 1.0;
+        double behind = static_cast<int64_t>(put_stream - m_in_buffer.stream_position(position)) * ratio;
+        if (m_resampling) behind += 1e-3 * m_resample_delay_ms * m_samplerate;
+        double timestamp = static_cast<double>(put_host) - behind;
+        return timestamp > 0.0 ? static_cast<uint64_t>(std::llround(timestamp)) : 0;
+    }
+    
+    void reset_stats() {
+        m_inference_latency.reset();
+        m_output_delay.reset();
+        m_stat_inferences = 0;
+        m_stat_busy = 0;
+        m_stat_errors = 0;
+        m_stat_coalesced = 0;
+        m_stat_gated = 0;
+        m_stat_queue_max = 0;
+        m_stats_base_overruns = m_in_buffer.overruns();
+        m_stats_base_underruns = m_in_buffer.underruns();
+    }
+    
+    // Warn once per model load when audio had to be dropped because inference fell behind
+    void report_overruns() {
+        if (m_overrun_reported || m_in_buffer.overruns() == 0) return;
+        cout << "Inference is falling behind, " << m_in_buffer.overruns() << " samples of audio dropped so far" << endl;
+        m_overrun_reported = true;
+    }
+    
+    // @auto: follow the share of each hop's duration that its forward takes, and once per
+    // evaluation period ask the loader for a larger chunk when deadlines are at risk or a
+    // smaller one after several periods of headroom (inference thread, model mutex held).
+    // Deadlines count as missed when the ring overran or results came later than a hop
+    // after their window. A pinned @hop keeps its budget while a larger chunk costs more,
+    // so the chunk then only steps down.
+    void adapt_chunk(double forward_us, double delay_us) {
+        double budget_us = 1e6 * m_hop_size / m_model_samplerate;
+        double load = forward_us / budget_us;
+        m_auto_load = m_auto_load < 0.0 ? load : m_auto_load + 0.05 * (load - m_auto_load);
+        m_auto_elapsed += budget_us * 1e-6;
+        ++m_auto_frames;
+        if (delay_us > budget_us) ++m_auto_late;
+        if (m_auto_step_pending) {
+            if (m_auto_limit.load() == 0) return;
+            m_auto_step_pending = false; // The loader had no model in that direction
+        }
+        if (m_auto_elapsed < k_auto_period_s) return;
+        
+        uint64_t overruns = m_in_buffer.overruns();
+        bool slipped = overruns != m_auto_overruns || m_auto_late > k_auto_late_share * m_auto_frames;
+        m_auto_overruns = overruns;
+        m_auto_frames = 0;
+        m_auto_late = 0;
+        m_auto_elapsed = 0.0;
+        
+        int step = 0;
+        if (slipped || m_auto_load > k_auto_high) {
+            if (m_hop_request == 0) step = 1;
+            m_auto_low_periods = 0;
+        } else if (m_auto_load < k_auto_low) {
+            if (++m_auto_low_periods >= k_auto_headroom_periods) step = -1;
+        } else {
+            m_auto_low_periods = 0;
+        }
+        if (step == 0 || step == m_auto_limit.load()) return;
+        
+        {
+            std::lock_guard<std::mutex> lock(m_loader_mutex);
+            if (m_load_request) return; // A load asked for elsewhere wins
+            m_load_request = LoadRequest { symbol(""), n_chunk_size, step };
+        }
+        m_auto_step_pending = true;
+        m_loader_wake.notify_one();
+    }
+    
+    // Measure a freshly swapped in model from scratch (inference thread)
+    void restart_adaptation() {
+        m_auto_load = -1.0;
+        m_auto_elapsed = 0.0;
+        m_auto_low_periods = 0;
+        m_auto_step_pending = false;
+        m_auto_limit.store(0);
+        m_auto_overruns = m_in_buffer.overruns();
+        m_auto_frames = 0;
+        m_auto_late = 0;
+    }
+    
+    // The requested hop rounded down to a divisor of a chunk size
+    int effective_hop(int chunk_size) const {
+        return divisor_hop(chunk_size, m_hop_request);
+    }
+    
+    // Join, leave or switch batch group to follow the batch attribute and loaded model
+    // (called from the inference thread with the model mutex held)
+    void update_batch_member() {
+        if (!m_batch_enabled || !m_model || m_sessions.size() > 1 || m_channels > 1) {
+            m_batch_member.reset();
+            return;
+        }
+        if (!m_batch_member || m_batch_member->model() != m_model.get() || m_batch_member->chunk_size() != n_chunk_size) {
+            m_batch_member.reset();
+            m_batch_member = BatchGroup::join(m_model, n_chunk_size);
+            m_batch_warned = false;
         }
     }
     
@@ -660,52 +2232,264 @@ private:
         
         // Check if we have enough samples
         if (m_in_buffer.available() < n_chunk_size) {
+            m_in_buffer.record_underrun();
             return;
         }
         
         m_error_reported = false;
 
         try {
-            // Get samples from circular buffer into pre-allocated buffer
-            if (!m_in_buffer.get(m_model_input_buffer.get(), n_chunk_size)) {
-                return; // Not enough samples available
-            }
-            
-            // Create tensor using pre-allocated buffer and pre-created options
-            torch::Tensor input_tensor = torch::from_blob(
-                m_model_input_buffer.get(), 
-                {1, (int)n_chunk_size}, 
-                m_tensor_options
-            ).clone();
-            
-            std::vector<torch::jit::IValue> inputs;
-            inputs.push_back(input_tensor);
-            
             // Thread-safe model inference
             std::lock_guard<std::mutex> lock(m_model_mutex);
-            auto outputs = m_module.forward(inputs);
-            auto output_tuple = outputs.toTuple();
-            
-            // Extract model outputs
-            float pitch = output_tuple->elements()[0].toTensor().item<float>();
-            float confidence = output_tuple->elements()[1].toTensor().item<float>();
-            float amplitude = output_tuple->elements()[2].toTensor().item<float>();
-            
-            // Apply confidence and amplitude thresholds
-            if ((m_confidence_threshold > 0.0 && confidence < m_confidence_threshold) ||
-                (m_amplitude_threshold > 0.0 && amplitude < m_amplitude_threshold)) {
-                pitch_output.send(-1500.0f);  // Low confidence/amplitude, output sentinel value
-            } else {
-                pitch_output.send(pitch);     // Normal or high confidence/amplitude
+            update_batch_member();
+            if (m_reset_requested.exchange(false, std::memory_order_acq_rel)) {
+                reset_sessions();
+                reset_trackers();
             }
             
-            confidence_output.send(confidence);
-            amplitude_output.send(amplitude);
+            // Process every analysis window available, one per hop. Each phase sees its
+            // own contiguous stream of chunks, read from the ring straight into its tensors.
+            float* inputs[k_max_channels];
+            size_t window_start = 0;
+            while (true) {
+                auto& session = m_sessions[m_hop_phase];
+                for (int channel = 0; channel < m_channels; ++channel) {
+                    inputs[channel] = session.input(channel);
+                }
+                if (!m_in_buffer.read_window(inputs, n_chunk_size, m_hop_size, &window_start)) break;
+                m_window_timestamp = host_timestamp(window_start);
+                
+                report_overruns();
+                m_hop_phase = (m_hop_phase + 1) % m_sessions.size();
+                
+                size_t backlog = m_in_buffer.available();
+                if (backlog > m_stat_queue_max.load(std::memory_order_relaxed)) m_stat_queue_max.store(backlog, std::memory_order_relaxed);
+                
+                bool gated = condition_inputs(inputs);
+                m_frame_poly = m_poly_count.load(std::memory_order_relaxed);
+                std::fill_n(m_candidate_counts, m_channels, uint8_t(0));
+                if (gated && !m_batch_member) {
+                    // Nothing to analyse. Settle the state once, so it starts from silence when the gate opens.
+                    if (!m_gate_closed) reset_sessions();
+                    m_gate_closed = true;
+                    std::fill(m_results.begin(), m_results.end(), PitchResult { -1500.0f, 0.0f, 0.0f });
+                    m_stat_gated.fetch_add(1, std::memory_order_relaxed);
+                } else {
+                    // A shared batch runs anyway, gated members feed it silence
+                    if (gated) std::fill_n(inputs[0], n_chunk_size, 0.0f);
+                    m_gate_closed = false;
+                    
+                    session.keep_activations(m_frame_poly > 0);
+                    auto start_time = std::chrono::steady_clock::now();
+                    bool session_ran = forward_chunk(session, m_results.data());
+                    auto end_time = std::chrono::steady_clock::now();
+                    double forward_us = std::chrono::duration<double, std::micro>(end_time - start_time).count();
+                    m_inference_latency.record(forward_us);
+                    double delay_us = output_delay(window_start + n_chunk_size, end_time);
+                    m_output_delay.record(delay_us);
+                    if (m_auto_enabled.load(std::memory_order_relaxed)) adapt_chunk(forward_us, delay_us);
+                    m_stat_inferences.fetch_add(1, std::memory_order_relaxed);
+                    if (m_frame_poly > 0) find_candidates(session, session_ran);
+                    
+                    // Apply gate, confidence and amplitude thresholds
+                    for (int channel = 0; channel < m_channels; ++channel) {
+                        PitchResult& result = m_results[channel];
+                        if (m_gated[channel]) {
+                            result = PitchResult { -1500.0f, 0.0f, 0.0f };
+                        } else if ((m_confidence_threshold > 0.0 && result.confidence < m_confidence_threshold) ||
+                                   (m_amplitude_threshold > 0.0 && result.amplitude < m_amplitude_threshold)) {
+                            result.pitch = -1500.0f;  // Low confidence/amplitude, output sentinel value
+                        }
+                    }
+                }
+                
+                post_process();
+                
+                // Schedule the first channel one chunk after the end of its window for the signal outlets
+                const PitchResult& first = m_results.front();
+                if (signal_mode != signal_modes::off) {
+                    m_signal_events.push({ { first.pitch, first.confidence, first.amplitude },
+                                           window_start + 2 * n_chunk_size, m_in_buffer.epoch() });
+                }
+                
+                queue_results();
+            }
         }
-        catch (const c10::Error& e) {
+        catch (const std::exception& e) {
+            m_stat_errors.fetch_add(1, std::memory_order_relaxed);
             cout << "Error running model inference: " << e.what() << endl;
         }
     }
+    
+    // Measure each channel's chunk, remove its DC offset and apply the gain in place, and
+    // mark the channels below @gate. Returns true when every channel is gated.
+    bool condition_inputs(float* const* inputs) {
+        bool all_gated = true;
+        for (int channel = 0; channel < m_channels; ++channel) {
+            ChunkLevel level = ChunkLevel::measure(inputs[channel], n_chunk_size);
+            level.condition(inputs[channel], n_chunk_size, m_remove_dc, m_input_gain);
+            m_gated[channel] = m_gate_threshold > 0.0 && level.rms < m_gate_threshold;
+            all_gated = all_gated && m_gated[channel];
+            if (channel == 0) {
+                m_input_rms.store(level.rms, std::memory_order_relaxed);
+                m_input_peak.store(level.peak, std::memory_order_relaxed);
+            }
+        }
+        return all_gated;
+    }
+    
+    // Run the chunks in a session's inputs through its module, or through the shared
+    // batch when batching is active (called with the model mutex held). Returns false
+    // when the results came from the shared batch.
+    bool forward_chunk(ChannelSession& session, PitchResult* results) {
+        auto deadline = std::chrono::microseconds(static_cast<long long>(0.5e6 * n_chunk_size / m_model_samplerate));
+        
+        if (m_batch_member && m_batch_member->process(session.input(0), deadline, results[0])) {
+            m_batch_served = true;
+            return false;
+        }
+        
+        // The session hasn't seen the chunks the shared batch ran, start it from its settled state
+        if (m_batch_served) {
+            session.reset();
+            m_batch_served = false;
+        }
+        
+        if (m_batch_member && !m_batch_member->batchable() && !m_batch_warned) {
+            cout << "Batched inference unavailable (" << m_batch_member->error() << "), running model per instance" << endl;
+            m_batch_warned = true;
+        }
+        
+        session.run(results);
+        
+        if (m_channels > 1 && !session.batched() && !m_split_reported) {
+            cout << "Batched inference unavailable (" << session.fallback_reason() << "), running model per channel" << endl;
+            m_split_reported = true;
+        }
+        return true;
+    }
+    
+    // Pick each ungated channel's polyphonic candidates from the activations of the
+    // session's last run, calibrated against the model's own pitch (inference thread)
+    void find_candidates(const ChannelSession& session, bool session_ran) {
+        bool available = false;
+        for (int channel = 0; channel < m_channels && session_ran; ++channel) {
+            const float* activations = session.activations(channel);
+            if (!activations) continue;
+            available = true;
+            if (m_gated[channel]) continue;
+            m_candidate_counts[channel] = static_cast<uint8_t>(m_candidate_pickers[channel].find(
+                activations, session.activation_bins(channel), m_results[channel].pitch,
+                m_frame_poly, m_poly_min_salience, m_candidates[channel]));
+        }
+        if (!available && !m_poly_warned) {
+            cout << (session_ran ? "Polyphonic candidates unavailable, the model returns no activations"
+                                 : "Polyphonic candidates unavailable with @batch") << endl;
+            m_poly_warned = true;
+        }
+    }
+    
+    // Hand the latest results to the scheduler without waiting on Max (inference thread).
+    // A full queue means the scheduler is far behind, the newest result is then dropped.
+    void queue_results() {
+        if (m_send_frames) {
+            ResultRecord record;
+            std::copy_n(m_results.begin(), m_channels, record.channels.begin());
+            record.timestamp = m_window_timestamp;
+            record.poly = m_frame_poly;
+            for (int channel = 0; channel < m_channels && m_frame_poly > 0; ++channel) {
+                record.candidate_counts[channel] = m_candidate_counts[channel];
+                std::copy_n(m_candidates[channel], m_candidate_counts[channel], record.candidates[channel]);
+            }
+            if (!m_result_queue.push(record)) {
+                m_stat_coalesced.fetch_add(1, std::memory_order_relaxed);
+            }
+        } else if (m_note_queue.size() == 0) {
+            return;
+        }
+        if (!m_results_scheduled.exchange(true, std::memory_order_acq_rel)) {
+            deliver_results.delay(0);
+        }
+    }
+    
+    // Smooth the latest frames and queue the note events they complete (inference thread)
+    void post_process() {
+        int note_frames = static_cast<int>(std::lround(1e-3 * m_note_min_ms * m_model_samplerate / m_hop_size));
+        PitchTracker::Settings settings { m_median_frames, m_hysteresis, m_notes_enabled, std::max(note_frames, 1) };
+        PitchTracker::NoteEvent events[2];
+        for (int channel = 0; channel < m_channels; ++channel) {
+            // Notes sounding when @notes was turned off are ended, not left hanging
+            if (m_segmenting && !settings.notes) queue_notes(events, m_trackers[channel].end_note(events), channel);
+            int count = m_trackers[channel].process(m_results[channel], settings, events);
+            queue_notes(events, count, channel);
+        }
+        m_segmenting = settings.notes;
+    }
+    
+    // End sounding notes and forget the smoothing history (inference thread)
+    void reset_trackers() {
+        PitchTracker::NoteEvent events[2];
+        for (int channel = 0; channel < m_channels; ++channel) {
+            queue_notes(events, m_trackers[channel].reset(events), channel);
+        }
+    }
+    
+    // Note-ons leave room for a note-off per channel, so a sounding note can always end.
+    // A note-on dropped for lack of room only leads to an unmatched note-off.
+    void queue_notes(const PitchTracker::NoteEvent* events, int count, int channel) {
+        for (int i = 0; i < count; ++i) {
+            bool room = !events[i].on || k_note_queue_capacity - m_note_queue.size() > static_cast<size_t>(m_channels);
+            if (!room || !m_note_queue.push({ events[i], channel, m_window_timestamp })) {
+                m_stat_coalesced.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    // 'time <sample> <ms>', sent before the result or note it belongs to
+    void send_timestamp(uint64_t sample) {
+        info_output.send(atoms { symbol("time"), static_cast<double>(sample), 1000.0 * sample / m_samplerate });
+    }
+    
+    // 'note on <note> <amplitude>' or 'note off <note>', with the channel when there are several
+    void send_note(const NoteRecord& note) {
+        atoms message { symbol("note"), symbol(note.event.on ? "on" : "off"), note.event.note };
+        if (note.event.on) message.push_back(note.event.amplitude);
+        if (m_channels > 1) message.push_back(note.channel + 1);
+        info_output.send(message);
+    }
+    
+    // 'poly <pitch> <salience> ...' per channel, strongest first, with the channel number
+    // in front when there are several. Frames without candidates send an empty 'poly'.
+    void send_candidates(const ResultRecord& record) {
+        for (int channel = 0; channel < m_channels; ++channel) {
+            atoms message { symbol("poly") };
+            if (m_channels > 1) message.push_back(channel + 1);
+            for (int i = 0; i < record.candidate_counts[channel]; ++i) {
+                message.push_back(record.candidates[channel][i].pitch);
+                message.push_back(record.candidates[channel][i].salience);
+            }
+            info_output.send(message);
+        }
+    }
+    
+    // Send pitch, confidence and amplitude, as lists when analysing several channels
+    void send_results(const ResultRecord& record) {
+        if (m_channels == 1) {
+            pitch_output.send(record.channels[0].pitch);
+            confidence_output.send(record.channels[0].confidence);
+            amplitude_output.send(record.channels[0].amplitude);
+            return;
+        }
+        
+        for (int channel = 0; channel < m_channels; ++channel) {
+            m_output_lists[0][channel] = record.channels[channel].pitch;
+            m_output_lists[1][channel] = record.channels[channel].confidence;
+            m_output_lists[2][channel] = record.channels[channel].amplitude;
+        }
+        pitch_output.send(m_output_lists[0]);
+        confidence_output.send(m_output_lists[1]);
+        amplitude_output.send(m_output_lists[2]);
+    }
 };
 
 
@@ -0,0 +1,382 @@
+/// @file
+///	@brief		Headless streaming benchmark of the pesto~ engine: runs WAV files through a model
+///				the way the external does, and reports forward latencies and the real-time factor
+///	@copyright	Copyright 2018 The Min-DevKit Authors. All rights reserved.
+///	@license	Use of this source code is governed by the MIT License found in the License.md file.
+
+#include "pesto_core.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char* k_usage =
+    "Usage: pesto_bench [options] <model.pt|model.onnx> <input.wav>...\n"
+    "\n"
+    "Streams each file through the model in host-sized blocks, one forward pass per hop,\n"
+    "and prints the forward latencies and the real-time factor of every file.\n"
+    "\n"
+    "Options:\n"
+    "  --chunk N      chunk size of an untagged model (default 512)\n"
+    "  --hop N        samples between analysis windows, rounded down to a divisor of\n"
+    "                 the chunk size (default: the chunk size)\n"
+    "  --block N      host vector size the audio is fed in (default 512)\n"
+    "  --device D     cpu, cuda or mps (default cpu)\n"
+    "  --optimize     freeze and optimize the model for inference\n"
+    "  --mmap         load from a mapped file and share the weights, as @mmap 1\n"
+    "  --threads N    intra-op threads (default: libtorch's choice)\n"
+    "  --repeat N     stream every file N times (default 1)\n"
+    "  --dc           remove each chunk's DC offset, as @dc 1\n"
+    "  --gain G       input gain, as @gain (default 1)\n"
+    "  --median N     running median frames, as @smooth (default 1)\n"
+    "  --csv PATH     write every frame as file,time,pitch,confidence,amplitude\n"
+    "  --bench N      also time N forwards on noise, single, batched and concurrent\n"
+    "  --max-p99 MS   exit with status 3 if a file's p99 forward latency exceeds MS milliseconds\n";
+
+struct Options {
+    std::string model;
+    std::vector<std::string> inputs;
+    int chunk = 512;
+    int hop = 0;
+    int block = 512;
+    std::string device = "cpu";
+    bool optimize = false;
+    bool mapped = false;
+    int threads = 0;
+    int repeat = 1;
+    bool remove_dc = false;
+    float gain = 1.0f;
+    int median = 1;
+    std::string csv;
+    int bench = 0;
+    double max_p99 = 0.0;
+};
+
+// Totals of one streamed file
+struct StreamReport {
+    size_t frames = 0;
+    double audio_seconds = 0.0;
+    double wall_seconds = 0.0;
+    uint64_t late = 0; // Forwards that took longer than one hop of audio
+    LatencyHistogram latency;
+};
+
+bool parse_options(int argc, char** argv, Options& options, std::string& error) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&](const char* name) -> const char* {
+            if (i + 1 >= argc) {
+                error = std::string(name) + " needs a value";
+                return nullptr;
+            }
+            return argv[++i];
+        };
+        const char* v = nullptr;
+        if (arg == "--optimize") {
+            options.optimize = true;
+        } else if (arg == "--mmap") {
+            options.mapped = true;
+        } else if (arg == "--dc") {
+            options.remove_dc = true;
+        } else if (arg == "--chunk" || arg == "--hop" || arg == "--block" || arg == "--threads" ||
+                   arg == "--repeat" || arg == "--median" || arg == "--bench") {
+            if (!(v = value(arg.c_str()))) return false;
+            int number = std::atoi(v);
+            if (arg == "--chunk") options.chunk = number;
+            else if (arg == "--hop") options.hop = number;
+            else if (arg == "--block") options.block = number;
+            else if (arg == "--threads") options.threads = number;
+            else if (arg == "--repeat") options.repeat = number;
+            else if (arg == "--median") options.median = number;
+            else options.bench = number;
+        } else if (arg == "--gain") {
+            if (!(v = value("--gain"))) return false;
+            options.gain = static_cast<float>(std::atof(v));
+        } else if (arg == "--max-p99") {
+            if (!(v = value("--max-p99"))) return false;
+            options.max_p99 = std::atof(v);
+        } else if (arg == "--device") {
+            if (!(v = value("--device"))) return false;
+            options.device = v;
+        } else if (arg == "--csv") {
+            if (!(v = value("--csv"))) return false;
+            options.csv = v;
+        } else if (arg == "-h" || arg == "--help") {
+            return false;
+        } else if (arg.size() > 1 && arg[0] == '-') {
+            error = "unknown option " + arg;
+            return false;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.empty()) {
+        error = "no model given";
+        return false;
+    }
+    if (positional.size() < 2 && options.bench <= 0) {
+        error = "no input files given";
+        return false;
+    }
+    if (options.chunk <= 0 || options.block <= 0 || options.repeat <= 0 || options.hop < 0) {
+        error = "--chunk, --block and --repeat must be positive";
+        return false;
+    }
+    options.model = positional.front();
+    options.inputs.assign(positional.begin() + 1, positional.end());
+    return true;
+}
+
+uint32_t read_le(const unsigned char* bytes, int count) {
+    uint32_t value = 0;
+    for (int i = count - 1; i >= 0; --i) value = (value << 8) | bytes[i];
+    return value;
+}
+
+// Read a RIFF WAVE file of 16, 24 or 32-bit integer or 32 or 64-bit float samples,
+// mixed down to mono
+bool read_wav(const std::string& path, std::vector<float>& audio, double& samplerate, std::string& error) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        error = "could not open the file";
+        return false;
+    }
+    std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (data.size() < 12 || std::memcmp(data.data(), "RIFF", 4) != 0 || std::memcmp(data.data() + 8, "WAVE", 4) != 0) {
+        error = "not a RIFF WAVE file";
+        return false;
+    }
+
+    int format = 0, channels = 0, bits = 0;
+    const unsigned char* samples = nullptr;
+    size_t sample_bytes = 0;
+    for (size_t pos = 12; pos + 8 <= data.size();) {
+        const unsigned char* chunk = data.data() + pos;
+        size_t size = read_le(chunk + 4, 4);
+        size_t body = std::min(size, data.size() - pos - 8);
+        if (std::memcmp(chunk, "fmt ", 4) == 0 && body >= 16) {
+            format = static_cast<int>(read_le(chunk + 8, 2));
+            channels = static_cast<int>(read_le(chunk + 10, 2));
+            samplerate = read_le(chunk + 12, 4);
+            bits = static_cast<int>(read_le(chunk + 22, 2));
+            if (format == 0xFFFE && body >= 26) format = static_cast<int>(read_le(chunk + 32, 2)); // Extensible, subformat GUID
+        } else if (std::memcmp(chunk, "data", 4) == 0) {
+            samples = chunk + 8;
+            sample_bytes = body;
+        }
+        pos += 8 + size + (size & 1);
+    }
+    bool integer = format == 1 && (bits == 16 || bits == 24 || bits == 32);
+    bool floating = format == 3 && (bits == 32 || bits == 64);
+    if (!samples || channels <= 0 || samplerate <= 0.0 || !(integer || floating)) {
+        error = "unsupported format (" + std::to_string(format) + ", " + std::to_string(bits) + " bits)";
+        return false;
+    }
+
+    int width = bits / 8;
+    size_t frames = sample_bytes / (width * channels);
+    audio.assign(frames, 0.0f);
+    for (size_t frame = 0; frame < frames; ++frame) {
+        double sum = 0.0;
+        for (int channel = 0; channel < channels; ++channel) {
+            const unsigned char* bytes = samples + (frame * channels + channel) * width;
+            if (floating && bits == 32) {
+                float value;
+                std::memcpy(&value, bytes, 4);
+                sum += value;
+            } else if (floating) {
+                double value;
+                std::memcpy(&value, bytes, 8);
+                sum += value;
+            } else {
+                // Sign-extend from the top byte
+                int32_t value = static_cast<int32_t>(read_le(bytes, width) << (32 - bits));
+                sum += value / 2147483648.0;
+            }
+        }
+        audio[frame] = static_cast<float>(sum / channels);
+    }
+    return true;
+}
+
+torch::Device parse_device(const std::string& name) {
+    if (name == "cuda" && torch::cuda::is_available()) return torch::kCUDA;
+    if (name == "mps" && torch::mps::is_available()) return torch::kMPS;
+    if (name != "cpu") std::cerr << name << " is not available, running on the CPU" << std::endl;
+    return torch::kCPU;
+}
+
+// Feed a recording to the ring one host vector at a time and run every window that
+// becomes available, as the external's audio and inference threads do in turn. With a
+// hop below the chunk size, consecutive windows go to the sessions in turn, one per hop
+// phase, so each sees a contiguous stream.
+void stream(const std::vector<float>& audio, double file_rate, double model_rate, const Options& options,
+            std::vector<ModelSession>& sessions, const std::string& name, std::ostream* csv, StreamReport& report) {
+    int chunk = sessions.front().chunk_size();
+    int hop = chunk / static_cast<int>(sessions.size());
+    double hop_us = 1e6 * hop / model_rate;
+
+    bool resampling = std::lround(file_rate) != std::lround(model_rate);
+    PolyphaseResampler resampler;
+    std::vector<float> converted;
+    if (resampling) {
+        resampler.configure(file_rate, model_rate);
+        converted.resize(resampler.max_output(PolyphaseResampler::k_max_block));
+    }
+
+    CircularBuffer ring;
+    ring.resize(std::max(4 * (chunk + options.block), 4096));
+    for (auto& session : sessions) session.reset();
+    size_t phase = 0;
+    PitchTracker tracker;
+    PitchTracker::Settings settings;
+    settings.median = options.median;
+    PitchTracker::NoteEvent events[2];
+
+    auto start_time = std::chrono::steady_clock::now();
+    size_t window_start = 0;
+    for (size_t offset = 0; offset < audio.size(); offset += options.block) {
+        size_t frames = std::min<size_t>(options.block, audio.size() - offset);
+        if (resampling) {
+            for (size_t done = 0; done < frames; done += PolyphaseResampler::k_max_block) {
+                size_t count = std::min(frames - done, PolyphaseResampler::k_max_block);
+                size_t produced = resampler.process(audio.data() + offset + done, count, converted.data());
+                ring.put(converted.data(), produced);
+            }
+        } else {
+            ring.put(audio.data() + offset, frames);
+        }
+
+        while (ring.read_window(sessions[phase].input(), chunk, hop, &window_start)) {
+            ModelSession& session = sessions[phase];
+            phase = (phase + 1) % sessions.size();
+            ChunkLevel::measure(session.input(), chunk).condition(session.input(), chunk, options.remove_dc, options.gain);
+            PitchResult result;
+            auto forward_start = std::chrono::steady_clock::now();
+            session.run(&result);
+            double forward_us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - forward_start).count();
+            report.latency.record(forward_us);
+            if (forward_us > hop_us) ++report.late;
+            tracker.process(result, settings, events);
+            ++report.frames;
+            if (csv) {
+                *csv << name << ',' << (window_start + chunk) / model_rate << ',' << result.pitch << ','
+                     << result.confidence << ',' << result.amplitude << '\n';
+            }
+        }
+    }
+    report.wall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    report.audio_seconds += audio.size() / file_rate;
+}
+
+void print_bench(std::shared_ptr<const ModelCache::Entry> model, int chunk, double model_rate, const Options& options) {
+    std::atomic<bool> cancel { false };
+    Benchmark benchmark(std::move(model), chunk, model_rate, options.threads, cancel);
+    std::vector<BenchResult> results;
+    for (int batch : { 1, 2, 4, 8 }) results.push_back(benchmark.batched(batch, options.bench));
+    for (int count : { 2, 4 }) {
+        if (count <= static_cast<int>(std::thread::hardware_concurrency())) results.push_back(benchmark.instances(count, options.bench));
+    }
+    for (const auto& result : results) {
+        std::printf("  %-9s %d: ", result.mode.c_str(), result.size);
+        if (!result.error.empty()) {
+            std::printf("%s\n", result.error.c_str());
+            continue;
+        }
+        std::printf("median %.3f ms, p99 %.3f ms, max %.3f ms, %.1f chunks/s, real-time factor %.4f\n",
+                    result.median_ms, result.p99_ms, result.max_ms, result.chunks_per_second, result.realtime_factor);
+    }
+}
+
+} // namespace
+
+
+int main(int argc, char** argv) {
+    Options options;
+    std::string error;
+    if (!parse_options(argc, argv, options, error)) {
+        if (!error.empty()) std::cerr << "pesto_bench: " << error << "\n\n";
+        std::cerr << k_usage;
+        return 1;
+    }
+
+    torch::NoGradGuard no_grad;
+    if (options.threads > 0) at::set_num_threads(options.threads);
+
+    ModelIndex::ModelFile tags = ModelIndex::parse(options.model);
+    int chunk = tags.chunk_size > 0 ? tags.chunk_size : options.chunk;
+    std::shared_ptr<const ModelCache::Entry> model;
+    try {
+        model = ModelCache::acquire(options.model, options.optimize, parse_device(options.device),
+                                    ModelIndex::precision_dtype(tags.precision), options.mapped);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "pesto_bench: could not load " << options.model << ": " << e.what() << std::endl;
+        return 2;
+    }
+    if (!model->warning().empty()) std::cerr << model->warning() << std::endl;
+    std::printf("%s: chunk %d, %s on %s\n", tags.filename.c_str(), chunk, tags.precision.c_str(), model->device().str().c_str());
+
+    // Rounded as @hop rounds it, to a divisor of the chunk size
+    int hop = divisor_hop(chunk, options.hop);
+    if (options.hop > 0 && hop != options.hop) {
+        std::cerr << "Hop size " << options.hop << " is not a divisor of " << chunk << ", using " << hop << std::endl;
+    }
+
+    std::ofstream csv_file;
+    if (!options.csv.empty()) {
+        csv_file.open(options.csv);
+        if (!csv_file) {
+            std::cerr << "pesto_bench: could not write " << options.csv << std::endl;
+            return 2;
+        }
+        csv_file << "file,time,pitch,confidence,amplitude\n";
+    }
+
+    int status = 0;
+    for (const auto& input : options.inputs) {
+        std::vector<float> audio;
+        double file_rate = 0.0;
+        if (!read_wav(input, audio, file_rate, error)) {
+            std::cerr << "pesto_bench: " << input << ": " << error << std::endl;
+            status = 2;
+            continue;
+        }
+        // Untagged models run at the recording's rate, as they run at the host's in Max
+        double model_rate = tags.rate_tag > 0 ? ModelIndex::rate_from_tag(tags.rate_tag) : file_rate;
+
+        StreamReport report;
+        try {
+            std::vector<ModelSession> sessions;
+            for (int phase = 0; phase < chunk / hop; ++phase) sessions.emplace_back(*model, chunk);
+            for (int pass = 0; pass < options.repeat; ++pass) {
+                stream(audio, file_rate, model_rate, options, sessions, input, csv_file.is_open() ? &csv_file : nullptr, report);
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << "pesto_bench: " << input << ": error running the model: " << e.what() << std::endl;
+            status = 2;
+            continue;
+        }
+
+        double p99 = report.latency.percentile(0.99);
+        std::printf("%s: %zu frames, %.2f s of audio in %.2f s, real-time factor %.4f\n", input.c_str(), report.frames,
+                    report.audio_seconds, report.wall_seconds, report.audio_seconds > 0.0 ? report.wall_seconds / report.audio_seconds : 0.0);
+        std::printf("  forward: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms, %llu over the %.3f ms hop\n",
+                    report.latency.percentile(0.5), report.latency.percentile(0.9), p99, report.latency.max(),
+                    static_cast<unsigned long long>(report.late), 1e3 * hop / model_rate);
+        if (options.max_p99 > 0.0 && p99 > options.max_p99 && status == 0) status = 3;
+    }
+
+    if (options.bench > 0) {
+        double model_rate = tags.rate_tag > 0 ? ModelIndex::rate_from_tag(tags.rate_tag) : 48000.0;
+        std::printf("bench, %d iterations:\n", options.bench);
+        print_bench(model, chunk, model_rate, options);
+    }
+    return status;
+}